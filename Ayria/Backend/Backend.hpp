@@ -24,11 +24,9 @@ namespace Backend::Backgroundtasks
 // Helper to add packets from / to different sources.
 namespace Backend::Synchronization
 {
+    // Handlers get the decoded payload straight from the ingest, RowID is the row in Rawsyncpacket.
     using Callback_t = void(__cdecl *)(const qDSA::Publickey_t &Publickey, int64_t RowID, int64_t Timestamp, const Bytebuffer_t &Payload);
 
-    // Fetch inserted messages.
-    Hashset<int64_t> getMessagerows();
-
     // Parse a message and insert into the client row.
     void Register(uint32_t Messagetype, Callback_t Callback);
     inline void Register(std::string_view Messagetype, Callback_t Callback)
@@ -36,10 +34,89 @@ namespace Backend::Synchronization
         return Register(Hash::WW32(Messagetype), Callback);
     }
 
+    // Identifies what a packet supersedes, e.g. a hash of a key within the payload.
+    using Subject_t = uint64_t(__cdecl *)(const Bytebuffer_t &Payload);
+
+    // How long packets are kept, zero means no limit; unregistered types are pruned after 24h if pruneDB is set.
+    // Compacted types only keep the newest packet per (Publickey, Messagetype, Subject), the subject defaults to 0.
+    // Ephemeral types are dispatched to the handlers but never stored, e.g. for control messages.
+    struct Retention_t
+    {
+        std::chrono::seconds Maxage{};
+        uint32_t Maxperpublisher{};
+        bool Compact{};
+        Subject_t Subject{};
+        bool Ephemeral{};
+    };
+    constexpr Retention_t Keepforever{};
+
+    // Registered with the handlers, the latest registration wins.
+    void Register(uint32_t Messagetype, const Retention_t &Policy);
+    inline void Register(std::string_view Messagetype, const Retention_t &Policy)
+    {
+        return Register(Hash::WW32(Messagetype), Policy);
+    }
+
+    // Types that have a handler or retention policy, safe to call from any thread.
+    bool isInteresting(uint32_t Messagetype);
+    std::vector<uint32_t> getInteresting();
+
+    // Streams stored packets of a type in (Timestamp, rowid) order, a batch at a time.
+    // Only rows that exist on creation are visible, newer ones go to the registered handlers.
+    class Replaycursor_t
+    {
+        uint32_t Messagetype;
+        int64_t Timestamp, RowID{ INT64_MIN }, Lastrow{};
+
+        public:
+        Replaycursor_t(uint32_t Messagetype, int64_t Since);
+
+        // Returns false once there's nothing more to deliver.
+        bool Next(Callback_t Callback, uint32_t Batchsize = 64);
+    };
+
+    // Replay in the background, one batch per tick; e.g. for services that register late.
+    void Replay(uint32_t Messagetype, int64_t Since, Callback_t Callback);
+    inline void Replay(std::string_view Messagetype, int64_t Since, Callback_t Callback)
+    {
+        return Replay(Hash::WW32(Messagetype), Since, Callback);
+    }
+
     // Create and insert messages into the database.
     Blob_t Createmessage(uint32_t Messagetype, const Bytebuffer_t &Payload);
     inline Blob_t Createmessage(std::string_view Messagetype, const Bytebuffer_t &Payload) { return Createmessage(Hash::WW32(Messagetype), Payload); }
     void Storemessage(const qDSA::Signature_t &Signature, const qDSA::Publickey_t &Publickey, uint32_t Messagetype, int64_t Timestamp, const Bytebuffer_t &Payload);
+
+    // Shares the receive-buffer until the packet is committed and dispatched, rather than copying it.
+    // The timestamp is as signed, i.e. with the envelope.
+    void Storemessage(const qDSA::Signature_t &Signature, const qDSA::Publickey_t &Publickey, uint32_t Messagetype, int64_t Timestamp, Sharedbuffer_t &&Payload);
+
+    // Payloads are stored as signed, i.e. possibly compressed; returns empty on corrupt data.
+    Blob_t Decompress(std::span<const uint8_t> Payload);
+
+    // Sequenced payloads start with the publishers sequence number, zero if there is none.
+    // Takes the signed timestamp or the Envelope column.
+    uint32_t getSequence(int64_t Timestamp, std::span<const uint8_t> Payload);
+    std::span<const uint8_t> Stripsequence(int64_t Timestamp, std::span<const uint8_t> Payload);
+}
+
+// Signature verification on a pool of worker threads.
+namespace Backend::Verification
+{
+    // What to do with new packets when a worker falls behind.
+    enum class Droppolicy_t : uint8_t { Dropnewest, Dropoldest };
+
+    struct Statistics_t
+    {
+        uint64_t Verified, Rejected, Dropped;
+        uint64_t Duplicates, Falsepositives;
+        uint64_t Ratelimited, Floodlimited;
+        size_t Queued;
+    };
+
+    // Takes a reference to a raw message, packets from the same publisher are verified in order.
+    void Enqueue(Sharedbuffer_t &&Packet);
+    Statistics_t getStatistics();
 }
 
 // Internal access to the database.
@@ -74,13 +151,56 @@ namespace Backend::Network
     };
     #pragma pack(pop)
 
+    // The low bits of the timestamp are envelope flags, covered by the signature.
+    // Older clients send raw timestamps, so the flags only count when the sign bit marks the envelope;
+    // a timestamp never has it set. Stored as separate columns, so that the Timestamp column stays comparable.
+    enum Envelope_t : int64_t
+    {
+        LZ4Compressed = 1 << 0, Sequenced = 1 << 1, Knownflags = LZ4Compressed | Sequenced,
+        Envelopemarker = INT64_MIN, Envelopemask = Envelopemarker | 0xF
+    };
+
+    // Zero for unmarked timestamps, takes either the raw timestamp or the Envelope column.
+    constexpr int64_t getEnvelope(int64_t Timestamp) { return (Timestamp & Envelopemarker) ? (Timestamp & Envelopemask) : 0; }
+    constexpr int64_t getTime(int64_t Timestamp) { return Timestamp & ~getEnvelope(Timestamp); }
+
+    // Marked packets with flags we don't know are from a newer version, and we can't read their payload.
+    constexpr bool isSupported(int64_t Timestamp) { return !(getEnvelope(Timestamp) & ~(Envelopemarker | Knownflags)); }
+
+    // Nanoseconds since 1970 for the header, high_resolution_clock is boot-relative on some platforms.
+    inline int64_t getTimestamp()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
     // Resolve the clients IP.
     inline uint32_t getInternalIP() { return {}; }
     inline uint32_t getExternalIP() { return {}; }
 
+    // Anything that carries packets, e.g. LAN multicast or the simulator.
+    enum class Scope_t : uint8_t { LAN, WAN };
+    using Transport_t = void(__cdecl *)(const Blob_t &Packet);
+    void Register(Scope_t Scope, Transport_t Transport);
+
+    // Transports hand complete messages back here, our own are filtered out.
+    void Receive(Sharedbuffer_t &&Message);
+
+    // Shortens the header for the wire, Receive() accepts both versions.
+    Blob_t Encodecompact(const Blob_t &Packet);
+
+    // Multicast channels, unrouted types use the base channel which every client joins.
+    // The game and mod channels fall back to the wider one while the ID is unset.
+    enum class Channel_t : uint8_t { Base, Game, Mod };
+    void Route(uint32_t Messagetype, Channel_t Channel);
+    inline void Route(std::string_view Messagetype, Channel_t Channel)
+    {
+        return Route(Hash::WW32(Messagetype), Channel);
+    }
+    Channel_t getChannel(uint32_t Messagetype);
+
     // Publish a payload to the network.
     void PublishLAN(const Blob_t &Packet, bool Delayed = false);
-    inline void PublishWAN(const Blob_t &Packet, bool Delayed = false) {}
+    void PublishWAN(const Blob_t &Packet, bool Delayed = false);
 
     // For internal use.
     inline void Publish(const Blob_t &Packet, bool Delayed = false)
@@ -90,12 +210,61 @@ namespace Backend::Network
     }
 }
 
+// Recovery of lost multicast packets, anything not recovered is left to reconciliation.
+namespace Backend::Network::Reliability
+{
+    // Continues from the last sequence in the DB.
+    uint32_t Nextsequence();
+
+    // Our own packets are kept for a while to answer NACKs.
+    void Remember(uint32_t Sequence, const Blob_t &Packet);
+
+    // Verified packets from other publishers, zero is ignored.
+    void Track(const qDSA::Publickey_t &Publickey, uint32_t Sequence);
+
+    // Packets dropped before verification, so that they are not reported as lost.
+    void Skip(const qDSA::Publickey_t &Publickey, uint32_t Sequence);
+}
+
+// Message types that clients handle, advertised so that forwarders can skip the rest.
+namespace Backend::Network::Interests
+{
+    // Only when filtering is enabled, otherwise everything is verified and stored for other clients.
+    bool isWanted(uint32_t Messagetype);
+
+    // True unless the peer advertised a set without this type.
+    bool isInterested(const qDSA::Publickey_t &Peer, uint32_t Messagetype);
+
+    // Stored by every client, i.e. not filtered by us or any peer; reconciliation only compares these.
+    bool isShared(uint32_t Messagetype);
+}
+
+// Datagrams that did not come from the socket, e.g. from a capture.
+namespace Backend::Network::LANNetworking
+{
+    void Ingest(Sharedbuffer_t Datagram);
+}
+
+// Recording of received datagrams and replay through the ingest path.
+namespace Backend::Network::Capture
+{
+    // No-op unless recording, called by the transports before parsing.
+    void Record(std::span<const uint8_t> Datagram);
+
+    // Per-stage timestamps for the replay statistics, no-op unless replaying.
+    enum class Stage_t : uint8_t { Received, Verified, Stored };
+    void Trace(Stage_t Stage, const qDSA::Signature_t &Signature);
+}
+
 // Load the the configuration from disk.
 namespace Backend::Config
 {
     // Fills Globalstate_t from ./Ayria/Config.json
     void Load();
 
+    // Optional settings for the backend that do not fit in Globalstate_t.
+    const JSON::Value_t &getSettings();
+
     // Helper to set the publickey.
     void setPublickey(std::u8string_view CredentialA, std::u8string_view CredentialB);
     void setPublickey_HWID();
@@ -0,0 +1,285 @@
+/*
+    Initial author: Convery (tcn@ayria.se)
+    Started: 2023-04-02
+    License: MIT
+
+    Records received datagrams to disk and replays them through the LAN ingest path, for reproducing load locally.
+    Replays need "Replaymode" in Config.json, which swaps in a scratch DB and keeps the client from publishing.
+    File: Magic, Version, then [uint32_t Microseconds since the previous record, uint16_t Size, Datagram] until the end.
+*/
+
+#include <Ayria.hpp>
+
+namespace Backend::Network::Capture
+{
+    constexpr uint32_t Capturemagic = Hash::WW32("Ayria::Capture");
+    constexpr uint32_t Captureversion = 1;
+
+    #pragma pack(push, 1)
+    struct Recordheader_t
+    {
+        uint32_t Delta;
+        uint16_t Size;
+    };
+    #pragma pack(pop)
+
+    // Copied on the receiving thread, written from our own.
+    struct Record_t
+    {
+        int64_t Time;
+        Blob_t Data;
+    };
+    static MPSCQueue_t<Record_t, 8192> Recordqueue{};
+    static std::atomic<bool> isRecording{}, isWriting{}, isReplaying{};
+    static std::atomic<uint64_t> Recorded{}, Recordedbytes{}, Recorddropped{};
+
+    // Stage timestamps for each message during a replay, keyed on the signature.
+    struct Trace_t
+    {
+        std::array<int64_t, 3> Stages{};
+    };
+    static Hashmap<uint64_t, Trace_t> Traces{};
+    static std::atomic<uint64_t> Traceupdates{};
+    static Spinlock_t Tracelock{};
+    constexpr size_t Maxtraces = 1024 * 1024;
+
+    static int64_t Now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Called by the transports before parsing.
+    void Record(std::span<const uint8_t> Datagram)
+    {
+        if (!isRecording.load(std::memory_order_relaxed)) [[likely]] return;
+        if (Datagram.size() > UINT16_MAX) [[unlikely]] return;
+
+        if (!Recordqueue.try_emplace(Now(), Blob_t(Datagram.data(), Datagram.size()))) [[unlikely]]
+            Recorddropped.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Only while replaying.
+    void Trace(Stage_t Stage, const qDSA::Signature_t &Signature)
+    {
+        if (!isReplaying.load(std::memory_order_relaxed)) [[likely]] return;
+
+        const auto Time = Now();
+        const auto Key = Hash::WW64(Signature.data(), Signature.size());
+        std::scoped_lock Guard(Tracelock);
+
+        if (Stage != Stage_t::Received && !Traces.contains(Key)) return;
+        if (Traces.size() >= Maxtraces && !Traces.contains(Key)) [[unlikely]] return;
+
+        auto &Entry = Traces[Key].Stages[size_t(Stage)];
+        if (!Entry) Entry = Time;
+        Traceupdates.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Drains the queue until recording stops.
+    static void Writerthread(std::FILE *File)
+    {
+        // Name this thread for easier debugging.
+        setThreadname("Ayria_Capture");
+
+        int64_t Previous{};
+        const auto Write = [&](Record_t &&Record)
+        {
+            if (!Previous) Previous = Record.Time;
+            const auto Delta = std::clamp<int64_t>((Record.Time - Previous) / 1000, 0, UINT32_MAX);
+            Previous = Record.Time;
+
+            const Recordheader_t Header{ uint32_t(Delta), uint16_t(Record.Data.size()) };
+            std::fwrite(&Header, sizeof(Header), 1, File);
+            std::fwrite(Record.Data.data(), 1, Record.Data.size(), File);
+
+            Recorded.fetch_add(1, std::memory_order_relaxed);
+            Recordedbytes.fetch_add(Record.Data.size(), std::memory_order_relaxed);
+        };
+
+        while (isRecording.load())
+        {
+            if (!Recordqueue.drain(Write)) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+
+        // Anything that was queued before stopping.
+        while (Recordqueue.drain(Write)) {}
+        std::fclose(File);
+
+        Infoprint(va("Capture: stopped after %llu datagrams, %llu bytes, %llu dropped", Recorded.load(), Recordedbytes.load(), Recorddropped.load()));
+        isWriting.store(false);
+    }
+
+    static bool Startrecording(const std::string &Filename)
+    {
+        if (isWriting.exchange(true)) return false;
+
+        const auto File = std::fopen(Filename.c_str(), "wb");
+        if (!File)
+        {
+            isWriting.store(false);
+            return false;
+        }
+
+        // Most records are small, so buffer a bit more than the default.
+        std::setvbuf(File, nullptr, _IOFBF, 1024 * 1024);
+        std::fwrite(&Capturemagic, sizeof(Capturemagic), 1, File);
+        std::fwrite(&Captureversion, sizeof(Captureversion), 1, File);
+
+        Recorded = 0; Recordedbytes = 0; Recorddropped = 0;
+        isRecording.store(true);
+        std::thread(Writerthread, File).detach();
+        return true;
+    }
+
+    // In microseconds.
+    static void Printpercentiles(const char *Stage, std::vector<int64_t> &Samples)
+    {
+        if (Samples.empty())
+        {
+            Infoprint(va("    %-8s no samples", Stage));
+            return;
+        }
+
+        std::ranges::sort(Samples);
+        const auto At = [&](double Percentile) { return double(Samples[std::min(Samples.size() - 1, size_t(Percentile * Samples.size()))]) / 1000.0; };
+        Infoprint(va("    %-8s %zu samples, p50 %.1f us, p90 %.1f us, p99 %.1f us, max %.1f us",
+                     Stage, Samples.size(), At(0.50), At(0.90), At(0.99), double(Samples.back()) / 1000.0));
+    }
+
+    // Speed is a multiplier of the recorded pace, zero replays as fast as possible.
+    static void Replaythread(std::string Filename, double Speed)
+    {
+        // Name this thread for easier debugging.
+        setThreadname("Ayria_Replay");
+
+        const auto File = std::fopen(Filename.c_str(), "rb");
+        if (!File)
+        {
+            Infoprint(va("Replay: could not open \"%s\"", Filename.c_str()));
+            isReplaying.store(false);
+            return;
+        }
+
+        uint32_t Magic{}, Version{};
+        if (1 != std::fread(&Magic, sizeof(Magic), 1, File) || 1 != std::fread(&Version, sizeof(Version), 1, File) ||
+            Magic != Capturemagic || Version != Captureversion)
+        {
+            Infoprint(va("Replay: \"%s\" is not a capture", Filename.c_str()));
+            std::fclose(File);
+            isReplaying.store(false);
+            return;
+        }
+
+        {
+            std::scoped_lock Guard(Tracelock);
+            Traces.clear();
+        }
+
+        const auto Before = Verification::getStatistics();
+        const auto Start = std::chrono::steady_clock::now();
+        std::vector<int64_t> Ingest{};
+        uint64_t Offset{}, Bytes{};
+
+        Recordheader_t Header{};
+        while (1 == std::fread(&Header, sizeof(Header), 1, File))
+        {
+            auto Datagram = Sharedbuffer_t::Allocate(Header.Size);
+            if (Header.Size && 1 != std::fread(Datagram.data(), Header.Size, 1, File)) [[unlikely]] break;
+
+            // Keep the recorded pace, scaled.
+            Offset += Header.Delta;
+            if (Speed > 0.0) std::this_thread::sleep_until(Start + std::chrono::microseconds(uint64_t(double(Offset) / Speed)));
+
+            const auto Begin = Now();
+            LANNetworking::Ingest(std::move(Datagram));
+            Ingest.emplace_back(Now() - Begin);
+            Bytes += Header.Size;
+        }
+        std::fclose(File);
+
+        const auto Seconds = std::max(std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count(), 1e-6);
+
+        // Until verification and storage have caught up, or give up after 10 seconds.
+        for (uint64_t Last = UINT64_MAX, i = 0; i < 100; ++i)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            const auto Current = Traceupdates.load();
+            if (Current == Last) break;
+            Last = Current;
+        }
+        isReplaying.store(false);
+
+        std::vector<int64_t> Verify{}, Store{}, Total{};
+        {
+            std::scoped_lock Guard(Tracelock);
+            for (const auto &[Key, Trace] : Traces)
+            {
+                const auto &[Received, Verified, Stored] = Trace.Stages;
+                if (Received && Verified) Verify.emplace_back(Verified - Received);
+                if (Verified && Stored) Store.emplace_back(Stored - Verified);
+                if (Received && Stored) Total.emplace_back(Stored - Received);
+            }
+            Traces.clear();
+        }
+
+        const auto After = Verification::getStatistics();
+        Infoprint(va("Replay: %zu datagrams, %llu bytes in %.3f sec, %.0f datagrams/sec, %.2f MiB/sec",
+                     Ingest.size(), Bytes, Seconds, double(Ingest.size()) / Seconds, double(Bytes) / Seconds / (1024 * 1024)));
+        Infoprint(va("    %llu verified, %llu rejected, %llu duplicates, %llu rate-limited, %llu dropped",
+                     After.Verified - Before.Verified, After.Rejected - Before.Rejected, After.Duplicates - Before.Duplicates,
+                     (After.Ratelimited + After.Floodlimited) - (Before.Ratelimited + Before.Floodlimited), After.Dropped - Before.Dropped));
+
+        Printpercentiles("Ingest", Ingest);
+        Printpercentiles("Verify", Verify);
+        Printpercentiles("Store", Store);
+        Printpercentiles("Total", Total);
+    }
+
+    // On startup.
+    static void __cdecl Initialize()
+    {
+        // Capture [File], without arguments it stops the current one.
+        static constexpr auto Capturecommand = [](int Argc, const char **Argv)
+        {
+            if (Argc == 0)
+            {
+                if (!isRecording.exchange(false)) Infoprint("Capture: not recording.");
+                return;
+            }
+
+            if (Startrecording(Argv[0])) Infoprint(va("Capture: recording to \"%s\"", Argv[0]));
+            else Infoprint(va("Capture: could not record to \"%s\", is a capture already running?", Argv[0]));
+        };
+        Communication::Console::addCommand(u8"Capture", Capturecommand);
+
+        // Replay File [Speed], zero is as fast as possible.
+        static constexpr auto Replaycommand = [](int Argc, const char **Argv)
+        {
+            if (Argc == 0)
+            {
+                Infoprint("Usage: Replay File [Speed]");
+                return;
+            }
+
+            // The handlers would write the replayed packets to the real DB and answer them on the network.
+            if (!Config::getSettings().value<bool>("Replaymode", false))
+            {
+                Infoprint("Replay: needs \"Replaymode\": true in Config.json, which uses a scratch DB and disables publishing.");
+                return;
+            }
+
+            if (isReplaying.exchange(true))
+            {
+                Infoprint("Replay: already running.");
+                return;
+            }
+
+            const auto Speed = Argc > 1 ? std::max(std::strtod(Argv[1], nullptr), 0.0) : 1.0;
+            std::thread(Replaythread, std::string(Argv[0]), Speed).detach();
+        };
+        Communication::Console::addCommand(u8"Replay", Replaycommand);
+    }
+
+    // Register initialization to run on startup.
+    struct Startup_t { Startup_t() { Backgroundtasks::addStartuptask(Initialize); } } Startup{};
+}
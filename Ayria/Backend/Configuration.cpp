@@ -9,11 +9,19 @@
 namespace Backend::Config
 {
     static std::string Configpath = "./Ayria/Config.json";
+    static JSON::Value_t Settings{};
+
+    // Optional settings for the backend that do not fit in Globalstate_t.
+    const JSON::Value_t &getSettings()
+    {
+        return Settings;
+    }
 
     // Save the configuration to disk.
     static void Saveconfig()
     {
-        JSON::Object_t Object{};
+        // Preserve any optional settings the user has added.
+        JSON::Object_t Object = Settings;
 
         // Need to cast the bits to bool as otherwise they'd be uint16.
         Object[u8"enableExternalconsole"] = (bool)Global.Configuration.enableExternalconsole;
@@ -37,6 +45,7 @@ namespace Backend::Config
         Global.Configuration.noNetworking = Config.value<bool>("noNetworking");
         Global.Configuration.pruneDB = Config.value<bool>("pruneDB", true);
         *Global.Username = Config.value(u8"Username", u8"AYRIA"s);
+        Settings = Config;
 
         // Select a source for crypto..
         if (std::strstr(GetCommandLineA(), "--randID"))
@@ -9,8 +9,14 @@
 // Internal access to the database.
 namespace Backend::Database
 {
-    static Hashmap<uint32_t, std::vector<Bytebuffer_t>> Modifiedrows{};
-    static Hashmap<uint32_t, std::vector<Bytebuffer_t>> Deletedrows{};
+    // Written from whichever thread modifies the DB, drained by the background thread.
+    struct Rowchange_t
+    {
+        uint32_t Tablehash;
+        bool isDeleted;
+        Blob_t Row;
+    };
+    static MPSCQueue_t<Rowchange_t, 8192> Changedrows{};
     static Hashmap<uint32_t, Hashset<Callback_t>> onModifiedCB{};
 
     // For debugging.
@@ -25,7 +31,7 @@ namespace Backend::Database
     {
         // Ignore internal tables.
         const auto Tablehash = Hash::WW32(std::string(Table));
-        if (Tablehash == Hash::WW32("Syncpacket") || Tablehash == Hash::WW32("Account"))
+        if (Tablehash == Hash::WW32("Rawsyncpacket") || Tablehash == Hash::WW32("Legacysyncpacket") || Tablehash == Hash::WW32("Account"))
             return;
 
         // Which interface is the relevant one.
@@ -59,10 +65,8 @@ namespace Backend::Database
             }
         }
 
-        if (Operation == SQLITE_DELETE)
-            Deletedrows[Tablehash].emplace_back(Tabledata);
-        else
-            Modifiedrows[Tablehash].emplace_back(Tabledata);
+        // Nothing to do but drop it if the background thread has stalled, it's tracked in the stats.
+        (void)Changedrows.try_emplace(Tablehash, Operation == SQLITE_DELETE, Blob_t(Tabledata.data(), Tabledata.size()));
     }
 
     // Callbacks on database modification.
@@ -73,6 +77,88 @@ namespace Backend::Database
 
     // Database setup and cleanup.
     static std::shared_ptr<sqlite3> DBConnection{};
+    static bool isMigrating{}, isScratch{};
+
+    // Keep plugin SQL that expects the text-form of Syncpacket working.
+    static void Createviews(bool withLegacy)
+    {
+        const sqlite::Database_t Database(DBConnection.get());
+
+        constexpr auto Syncpacket =
+            "CREATE VIEW Syncpacket AS SELECT "
+            "B58Encode(Publickey) AS Publickey, "
+            "B58Encode(Signature) AS Signature, "
+            "Messagetype, Timestamp, "
+            "B85Encode(Unpack(Envelope, Data)) AS Data FROM Rawsyncpacket";
+
+        Database << "DROP VIEW IF EXISTS Syncpacket;";
+        if (withLegacy) Database << (std::string(Syncpacket) + " UNION ALL SELECT * FROM Legacysyncpacket;");
+        else Database << (std::string(Syncpacket) + ";");
+
+        isMigrating = withLegacy;
+    }
+
+    // Move the v1 rows in small batches to not stall the background thread.
+    // Newest first and keeping their rowids, so that new packets get rowids after all of them.
+    static void __cdecl Migratesyncpackets()
+    {
+        if (!isMigrating) [[likely]] return;
+
+        const sqlite::Database_t Database(DBConnection.get());
+        using Legacyrow_t = std::tuple<int64_t, std::u8string, std::u8string, uint32_t, int64_t, Blob_t>;
+        std::vector<Legacyrow_t> Rows{};
+        Rows.reserve(512);
+
+        Database << "SELECT rowid, * FROM Legacysyncpacket ORDER BY rowid DESC LIMIT 512;"
+                 >> [&](int64_t RowID, const std::u8string &Publickey, const std::u8string &Signature, uint32_t Messagetype, int64_t Timestamp, const Blob_t &Data)
+        {
+            Rows.emplace_back(RowID, Publickey, Signature, Messagetype, Timestamp, Data);
+        };
+
+        // All done, drop the old table and restore the view.
+        if (Rows.empty())
+        {
+            Createviews(false);
+            Database << "DROP TABLE IF EXISTS Legacysyncpacket;";
+            Database << "PRAGMA user_version = 3;";
+
+            Infoprint("Syncpacket migration done.");
+            return;
+        }
+
+        Database << "BEGIN IMMEDIATE TRANSACTION;";
+        {
+            // Legacy packets have no envelope, the timestamp is kept as signed and read as-is.
+            auto Insert = Database << "INSERT OR IGNORE INTO Rawsyncpacket (rowid, Publickey, Signature, Messagetype, Timestamp, Envelope, Data) VALUES (?, ?, ?, ?, ?, 0, ?);";
+            auto Fallback = Database << "INSERT OR IGNORE INTO Rawsyncpacket (Publickey, Signature, Messagetype, Timestamp, Envelope, Data) VALUES (?, ?, ?, ?, 0, ?);";
+            for (const auto &[RowID, Publickey, Signature, Messagetype, Timestamp, Data] : Rows)
+            {
+                const auto PK = Base58::Decode(Publickey);
+                const auto Sig = Base58::Decode(Signature);
+
+                // Corrupt rows are dropped.
+                if (PK.size() != sizeof(qDSA::Publickey_t) || Sig.size() != sizeof(qDSA::Signature_t)) [[unlikely]]
+                    continue;
+
+                const auto Payload = Blob_t(Base85::Decode(Data));
+                Insert << RowID << Blob_view_t(PK.data(), PK.size()) << Blob_view_t(Sig.data(), Sig.size());
+                Insert << Messagetype << Timestamp << Payload;
+                Insert.Execute();
+
+                // Only if the rowid was taken, a duplicate packet is ignored again.
+                if (sqlite3_changes(Database.Connection) == 0) [[unlikely]]
+                {
+                    Fallback << Blob_view_t(PK.data(), PK.size()) << Blob_view_t(Sig.data(), Sig.size());
+                    Fallback << Messagetype << Timestamp << Payload;
+                    Fallback.Execute();
+                }
+            }
+
+            Database << "DELETE FROM Legacysyncpacket WHERE rowid >= ?;" << std::get<0>(Rows.back());
+        }
+        Database << "COMMIT TRANSACTION;";
+    }
+
     static void InitializeDB()
     {
         const sqlite::Database_t Database(DBConnection.get());
@@ -121,6 +207,96 @@ namespace Backend::Database
             sqlite3_create_function(Database.Connection, "ShortID", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS, nullptr, Lambda, nullptr, nullptr);
         }
 
+        // Helper functions for the text-form of binary columns.
+        {
+            static constexpr auto B58Encode = [](sqlite3_context *context, int argc, sqlite3_value **argv) -> void
+            {
+                if (argc == 0) return;
+                if (SQLITE_BLOB != sqlite3_value_type(argv[0])) { sqlite3_result_null(context); return; }
+
+                // SQLite may invalidate the pointer if _bytes is called before blob.
+                const auto Data = (const uint8_t *)sqlite3_value_blob(argv[0]);
+                const auto Length = sqlite3_value_bytes(argv[0]);
+                const auto Encoded = Base58::Encode(std::span(Data, Length));
+
+                sqlite3_result_text(context, (const char *)Encoded.data(), int(Encoded.size()), SQLITE_TRANSIENT);
+            };
+            static constexpr auto B58Decode = [](sqlite3_context *context, int argc, sqlite3_value **argv) -> void
+            {
+                if (argc == 0) return;
+                if (SQLITE3_TEXT != sqlite3_value_type(argv[0])) { sqlite3_result_null(context); return; }
+
+                // SQLite may invalidate the pointer if _bytes is called before text.
+                const auto Data = (const uint8_t *)sqlite3_value_text(argv[0]);
+                const auto Length = sqlite3_value_bytes(argv[0]);
+                const auto Decoded = Base58::Decode(std::span(Data, Length));
+
+                sqlite3_result_blob(context, Decoded.data(), int(Decoded.size()), SQLITE_TRANSIENT);
+            };
+            static constexpr auto B85Encode = [](sqlite3_context *context, int argc, sqlite3_value **argv) -> void
+            {
+                if (argc == 0) return;
+                if (SQLITE_BLOB != sqlite3_value_type(argv[0])) { sqlite3_result_null(context); return; }
+
+                // SQLite may invalidate the pointer if _bytes is called before blob.
+                const auto Data = (const uint8_t *)sqlite3_value_blob(argv[0]);
+                const auto Length = sqlite3_value_bytes(argv[0]);
+                const auto Encoded = Base85::Encode(std::span(Data, Length));
+
+                // The v1 layout stored the text in a BLOB column.
+                sqlite3_result_blob(context, Encoded.data(), int(Encoded.size()), SQLITE_TRANSIENT);
+            };
+
+            static constexpr auto Unpack = [](sqlite3_context *context, int argc, sqlite3_value **argv) -> void
+            {
+                if (argc != 2) return;
+                if (SQLITE_BLOB != sqlite3_value_type(argv[1])) { sqlite3_result_null(context); return; }
+
+                // SQLite may invalidate the pointer if _bytes is called before blob.
+                const auto Data = (const uint8_t *)sqlite3_value_blob(argv[1]);
+                const auto Length = sqlite3_value_bytes(argv[1]);
+
+                // Payloads are stored as signed, NULL is read as zero.
+                const auto Envelope = Network::getEnvelope(sqlite3_value_int64(argv[0]));
+                if (!Envelope) { sqlite3_result_value(context, argv[1]); return; }
+
+                const auto Body = Synchronization::Stripsequence(Envelope, std::span(Data, Length));
+                if (!(Envelope & Network::LZ4Compressed)) { sqlite3_result_blob(context, Body.data(), int(Body.size()), SQLITE_TRANSIENT); return; }
+
+                const auto Decompressed = Synchronization::Decompress(Body);
+                sqlite3_result_blob(context, Decompressed.data(), int(Decompressed.size()), SQLITE_TRANSIENT);
+            };
+
+            sqlite3_create_function(Database.Connection, "B58Encode", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS, nullptr, B58Encode, nullptr, nullptr);
+            sqlite3_create_function(Database.Connection, "B58Decode", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS, nullptr, B58Decode, nullptr, nullptr);
+            sqlite3_create_function(Database.Connection, "B85Encode", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS, nullptr, B85Encode, nullptr, nullptr);
+            sqlite3_create_function(Database.Connection, "Unpack", 2, SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS, nullptr, Unpack, nullptr, nullptr);
+        }
+
+        // Order-independent digest of a set of blobs, for comparing ranges between clients.
+        {
+            static constexpr auto Digeststep = [](sqlite3_context *context, int argc, sqlite3_value **argv) -> void
+            {
+                if (argc == 0) return;
+                if (SQLITE_BLOB != sqlite3_value_type(argv[0])) return;
+
+                const auto State = (uint64_t *)sqlite3_aggregate_context(context, sizeof(uint64_t));
+                if (!State) return;
+
+                // SQLite may invalidate the pointer if _bytes is called before blob.
+                const auto Data = (const uint8_t *)sqlite3_value_blob(argv[0]);
+                const auto Length = sqlite3_value_bytes(argv[0]);
+                *State ^= Hash::WW64(std::span(Data, Length));
+            };
+            static constexpr auto Digestfinal = [](sqlite3_context *context) -> void
+            {
+                const auto State = (uint64_t *)sqlite3_aggregate_context(context, 0);
+                sqlite3_result_int64(context, State ? int64_t(*State) : 0);
+            };
+
+            sqlite3_create_function(Database.Connection, "Digest", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS, nullptr, nullptr, Digeststep, Digestfinal);
+        }
+
         // All tables depend on the account as primary identifier.
         constexpr auto Account =
             "CREATE TABLE IF NOT EXISTS Account ("
@@ -129,6 +305,66 @@ namespace Backend::Database
             "Lastseen INTEGER, "
             "ShortID INTEGER );";
         Database << Account;
+
+        // Raw keys, signatures, and payloads.
+        constexpr auto Rawsyncpacket =
+            "CREATE TABLE IF NOT EXISTS Rawsyncpacket ("
+            "Publickey BLOB, "
+            "Signature BLOB, "
+
+            "Messagetype INTEGER, "
+            "Timestamp INTEGER, "
+            "Envelope INTEGER NOT NULL DEFAULT 0, "
+
+            "Data BLOB,"
+            "Subject INTEGER,"
+            "UNIQUE (Publickey, Signature) );";
+        Database << Rawsyncpacket;
+
+        // v2 databases lack the compaction key.
+        int64_t hasSubject{};
+        Database << "SELECT COUNT(*) FROM pragma_table_info('Rawsyncpacket') WHERE name = 'Subject';" >> hasSubject;
+        if (!hasSubject) Database << "ALTER TABLE Rawsyncpacket ADD COLUMN Subject INTEGER;";
+
+        // As do the ones from before the envelope marker, their timestamps are read as-is.
+        int64_t hasEnvelope{};
+        Database << "SELECT COUNT(*) FROM pragma_table_info('Rawsyncpacket') WHERE name = 'Envelope';" >> hasEnvelope;
+        if (!hasEnvelope) Database << "ALTER TABLE Rawsyncpacket ADD COLUMN Envelope INTEGER NOT NULL DEFAULT 0;";
+
+        // For pruning and replaying by time.
+        Database << "CREATE INDEX IF NOT EXISTS Rawsyncpacket_Timestamp ON Rawsyncpacket (Timestamp);";
+        Database << "CREATE INDEX IF NOT EXISTS Rawsyncpacket_Messagetype ON Rawsyncpacket (Messagetype, Timestamp);";
+
+        // Only compacted types have a subject.
+        Database << "CREATE INDEX IF NOT EXISTS Rawsyncpacket_Subject ON Rawsyncpacket (Publickey, Messagetype, Subject, Timestamp) WHERE Subject IS NOT NULL;";
+
+        // Binary keys can't reference Account directly.
+        sqlite3_exec(Database.Connection,
+            "CREATE TRIGGER IF NOT EXISTS Accountcascade AFTER DELETE ON Account BEGIN "
+            "DELETE FROM Rawsyncpacket WHERE Publickey = B58Decode(OLD.Publickey); END;", nullptr, nullptr, nullptr);
+
+        // Databases from before v2 are migrated in the background.
+        std::string Tabletype{};
+        Database << "SELECT type FROM sqlite_master WHERE name = 'Syncpacket';" >> Tabletype;
+        if (Tabletype == "table")
+        {
+            // Other tables keep referencing Syncpacket, which becomes the view.
+            Database << "PRAGMA foreign_keys = OFF;";
+            Database << "PRAGMA legacy_alter_table = ON;";
+            Database << "ALTER TABLE Syncpacket RENAME TO Legacysyncpacket;";
+            Database << "PRAGMA legacy_alter_table = OFF;";
+            Database << "PRAGMA foreign_keys = ON;";
+        }
+
+        std::string Legacytable{};
+        Database << "SELECT name FROM sqlite_master WHERE name = 'Legacysyncpacket';" >> Legacytable;
+        Createviews(!Legacytable.empty());
+
+        // The newest rows are moved before anything new is stored, so their rowids stay free.
+        if (!Legacytable.empty()) Migratesyncpackets();
+
+        if (Legacytable.empty()) Database << "PRAGMA user_version = 3;";
+        else Infoprint("Migrating Syncpacket to the v2 layout in the background.");
     }
     static void CleanupDB(sqlite3 *Connection)
     {
@@ -138,9 +374,9 @@ namespace Backend::Database
         Database << "PRAGMA incremental_vacuum;";
         Database << "PRAGMA optimize;";
 
-        // If this is an in-memory DB, try to flush to disk.
+        // If this is an in-memory DB, try to flush to disk; unless it's a scratch DB for replays.
         const auto Filename = sqlite3_db_filename(Connection, "main");
-        if (!Filename || ""s == Filename)
+        if (!isScratch && (!Filename || ""s == Filename))
         {
             sqlite3 *Ptr{};
             auto Result = sqlite3_open_v2("./Ayria/Client.sqlite", &Ptr, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX, nullptr);
@@ -171,9 +407,14 @@ namespace Backend::Database
         if (!DBConnection) [[unlikely]]
         {
             sqlite3 *Ptr{};
+            int Result{ SQLITE_CANTOPEN };
+
+            // Replays must not touch the real DB, so they get an empty one that is never saved.
+            isScratch = Config::getSettings().value<bool>("Replaymode", false);
+            if (isScratch) Result = sqlite3_open_v2("file:Ayriareplay?mode=memory&cache=shared", &Ptr, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX | SQLITE_OPEN_URI, nullptr);
+            else Result = sqlite3_open_v2("./Ayria/Client.sqlite", &Ptr, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX, nullptr);
 
             // :memory: should never fail unless the client has more serious problems.
-            auto Result = sqlite3_open_v2("./Ayria/Client.sqlite", &Ptr, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX, nullptr);
             if (Result != SQLITE_OK) Result = sqlite3_open_v2("file:Ayria?mode=memory&cache=shared", &Ptr, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX | SQLITE_OPEN_URI, nullptr);
             assert(Result == SQLITE_OK);
 
@@ -196,40 +437,36 @@ namespace Backend::Database
     // Poll for updates every 50ms.
     static void __cdecl Poll()
     {
-        Hashmap<uint32_t, std::vector<Bytebuffer_t>> Modified{};
-        Hashmap<uint32_t, std::vector<Bytebuffer_t>> Deleted{};
-        Modifiedrows.swap(Modified);
-        Deletedrows.swap(Deleted);
+        static uint64_t Lastrejected{};
 
-        // Pump to any interested handlers.
-        for (const auto &[Type, Rows] : Deleted)
+        // Pump to any interested handlers, in the order they happened.
+        Changedrows.drain([](Rowchange_t &&Change)
         {
-            if (onModifiedCB.contains(Type))
+            const auto Callbacks = onModifiedCB.find(Change.Tablehash);
+            if (Callbacks == onModifiedCB.end()) return;
+
+            const auto Row = Bytebuffer_t(Change.Row);
+            for (const auto &Callback : Callbacks->second)
             {
-                for (const auto &Row : Rows)
-                {
-                    for (const auto &Callback : onModifiedCB[Type])
-                    {
-                        Callback(true, Row);
-                    }
-                }
+                Callback(Change.isDeleted, Row);
             }
-        }
-        for (const auto &[Type, Rows] : Modified)
+        });
+
+        // Let the developer know that the queue needs to be larger.
+        if (const auto Stats = Changedrows.getStatistics(); Stats.Rejected != Lastrejected) [[unlikely]]
         {
-            if (onModifiedCB.contains(Type))
-            {
-                for (const auto &Row : Rows)
-                {
-                    for (const auto &Callback : onModifiedCB[Type])
-                    {
-                        Callback(false, Row);
-                    }
-                }
-            }
+            Debugprint(va("Database: dropped %llu row-changes, highwater %zu", Stats.Rejected - Lastrejected, Stats.Highwater));
+            Lastrejected = Stats.Rejected;
         }
     }
 
-    // Register background task.
-    struct Startup_t { Startup_t() { Backgroundtasks::addPeriodictask(Poll, 50); } } Startup{};
+    // Register background tasks.
+    struct Startup_t
+    {
+        Startup_t()
+        {
+            Backgroundtasks::addPeriodictask(Poll, 50);
+            Backgroundtasks::addPeriodictask(Migratesyncpackets, 100);
+        }
+    } Startup{};
 }
@@ -0,0 +1,146 @@
+/*
+    Initial author: Convery (tcn@ayria.se)
+    Started: 2023-04-03
+    License: MIT
+
+    Clients that only verify and store the types they handle advertise them as a small bloom filter.
+    Forwarders skip peers that are not interested, false positives just mean an unneeded send.
+    Only advertised while filtering, and reconciliation leaves the filtered types out as not every peer stores them.
+*/
+
+#include <Ayria.hpp>
+
+namespace Backend::Network::Interests
+{
+    // 2048 bits with 3 probes, ~1% false positives at 200 types.
+    constexpr size_t Filterbits = 2048;
+    using Filter_t = std::array<uint8_t, Filterbits / 8>;
+
+    struct Advertised_t
+    {
+        Filter_t Filter;
+        uint32_t Received;
+    };
+    static Hashmap<qDSA::Publickey_t, Advertised_t, decltype(WW64::Hash)> Peers{};
+    static Spinlock_t Peerlock{};
+    constexpr size_t Maxpeers = 4096;
+
+    // Configurable via Config.json.
+    static bool useFilter{};
+    static uint32_t Advertiseperiod{ 30000 };
+
+    // For tuning the filter.
+    static std::atomic<uint64_t> Dropped{}, Advertisements{};
+
+    static std::array<size_t, 3> Probes(uint32_t Messagetype)
+    {
+        const auto Value = Hash::WW64(&Messagetype, sizeof(Messagetype));
+        return { Value % Filterbits, (Value >> 21) % Filterbits, (Value >> 42) % Filterbits };
+    }
+
+    // Only when filtering is enabled.
+    bool isWanted(uint32_t Messagetype)
+    {
+        if (!useFilter || Synchronization::isInteresting(Messagetype)) [[likely]] return true;
+
+        Dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    // Stale advertisements get everything.
+    static bool Matches(const Advertised_t &Advertised, const std::array<size_t, 3> &Bits, uint32_t Now)
+    {
+        if (Now - Advertised.Received > Advertiseperiod * 3) return true;
+
+        return std::ranges::all_of(Bits, [&](size_t Bit)
+        {
+            return Advertised.Filter[Bit / 8] & (1 << (Bit % 8));
+        });
+    }
+
+    // Unknown peers get everything.
+    bool isInterested(const qDSA::Publickey_t &Peer, uint32_t Messagetype)
+    {
+        std::scoped_lock Guard(Peerlock);
+
+        const auto Entry = Peers.find(Peer);
+        if (Entry == Peers.end()) return true;
+
+        return Matches(Entry->second, Probes(Messagetype), GetTickCount());
+    }
+
+    // Bloom false positives count as shared, so a type may still be compared with a peer that drops it.
+    bool isShared(uint32_t Messagetype)
+    {
+        if (useFilter && !Synchronization::isInteresting(Messagetype)) return false;
+
+        const auto Bits = Probes(Messagetype);
+        const auto Now = GetTickCount();
+        std::scoped_lock Guard(Peerlock);
+
+        return std::ranges::all_of(Peers, [&](const auto &Entry) { return Matches(Entry.second, Bits, Now); });
+    }
+
+    // A peer changed its handlers, or it's the periodic refresh.
+    static void __cdecl onInterest(const qDSA::Publickey_t &Publickey, int64_t, int64_t, const Bytebuffer_t &Payload)
+    {
+        if (Payload.size() != sizeof(Filter_t)) [[unlikely]] return;
+
+        Advertised_t Entry{ {}, GetTickCount() };
+        std::memcpy(Entry.Filter.data(), Payload.data(), Entry.Filter.size());
+
+        std::scoped_lock Guard(Peerlock);
+        if (Peers.size() >= Maxpeers && !Peers.contains(Publickey)) [[unlikely]] Peers.clear();
+        Peers[Publickey] = Entry;
+    }
+
+    // Every second, advertised when the set changes or the period passes.
+    static void __cdecl Advertise()
+    {
+        static size_t Lastcount{};
+        static uint32_t Lastsent{};
+
+        const auto Types = Synchronization::getInteresting();
+        if (Types.size() == Lastcount && GetTickCount() - Lastsent < Advertiseperiod) [[likely]] return;
+
+        Filter_t Filter{};
+        for (const auto Type : Types)
+            for (const auto Bit : Probes(Type))
+                Filter[Bit / 8] |= uint8_t(1 << (Bit % 8));
+
+        Lastcount = Types.size();
+        Lastsent = GetTickCount();
+
+        Publish(Synchronization::Createmessage("Network::Interest", Bytebuffer_t(Filter.data(), Filter.size())));
+        Advertisements.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // On startup.
+    static void __cdecl Initialize()
+    {
+        const auto &Settings = Config::getSettings();
+        useFilter = Settings.value<bool>("Interestfilter", useFilter);
+        Advertiseperiod = std::max(Settings.value<uint32_t>("Interestperiod", Advertiseperiod), 1000U);
+
+        // Everyone tracks the advertisements, even if not filtering themselves.
+        Synchronization::Register("Network::Interest", Synchronization::Retention_t{ .Ephemeral = true });
+        Synchronization::Register("Network::Interest", onInterest);
+        if (useFilter) Enqueuetask(Advertise, 1000);
+
+        static constexpr auto Printstats = [](int, const char **)
+        {
+            size_t Peercount{};
+            {
+                std::scoped_lock Guard(Peerlock);
+                Peercount = Peers.size();
+            }
+
+            Infoprint(va("Interests: filtering %s, %zu local types, %llu dropped, %llu advertised, %zu peers filtering",
+                         useFilter ? "enabled" : "disabled", Synchronization::getInteresting().size(), Dropped.load(), Advertisements.load(), Peercount));
+        };
+        Communication::Console::addCommand(u8"Intereststats", Printstats);
+    }
+
+    // Register initialization to run on startup.
+    struct Startup_t { Startup_t() { Backgroundtasks::addStartuptask(Initialize); } } Startup{};
+}
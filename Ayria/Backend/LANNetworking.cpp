@@ -11,90 +11,578 @@ namespace Backend::Network::LANNetworking
     constexpr uint32_t Broadcastaddress = Hash::FNV1_32("Ayria"sv) << 8;    // 228.58.137.0
     constexpr uint16_t Broadcastport = Hash::FNV1_32("Ayria"sv) & 0xFFFF;   // 14985
 
-    constexpr sockaddr_in Multicast{ AF_INET, cmp::toBig(Broadcastport), {{.S_addr = cmp::toBig(Broadcastaddress)}} };
-    static std::queue<Blob_t> Packetqueue{};
     static size_t Broadcastsocket{};
-    static Spinlock_t Threadsafe;
+
+    // Group per channel, the derived ones share the /16 of the base group so collisions just share a group.
+    static std::array<uint32_t, 3> Channels{ Broadcastaddress, Broadcastaddress, Broadcastaddress };
+    static std::vector<uint32_t> Memberships{};
+    static std::array<uint32_t, 2> Joined{};
+    static bool useChannels{ true };
+
+    // Small messages are coalesced into one datagram and larger ones are split, see Framing.hpp.
+    static Blob_t Bundle{};
+    static size_t Bundlecount{};
+    static uint32_t Bundlegroup{};
+    static std::chrono::steady_clock::time_point Bundledeadline{};
+
+    // Datagrams waiting for the transmit thread, in order.
+    struct Frame_t
+    {
+        Blob_t Data;
+        uint32_t Group;
+        std::chrono::steady_clock::time_point Queued;
+    };
+    static std::deque<Frame_t> Transmitqueue{};
+    static std::condition_variable Transmitsignal{};
+    static std::mutex Transmitlock{};
+
+    // Received datagrams are shared with verification and storage, so the pool is never freed.
+    // Covers jumbo frames, larger datagrams are not ours.
+    using Receivepool_t = Bufferpool_t<9216, 1024>;
+    static auto &Receivepool = *new Receivepool_t();
+
+    // Every receiving socket has its own thread and pool, the first one is also used for sending.
+    // Extra sockets share the port via SO_REUSEPORT; the kernel spreads unicast between them by sender,
+    // but multicast would be delivered to all of them, so only the first one receives the group.
+    // It hands the group's datagrams on by sender, so that all threads share the parsing and a sender's fragments stay together.
+    struct Shard_t
+    {
+        size_t Socket;
+        Receivepool_t &Pool;
+        std::atomic<uint64_t> Datagrams{}, Bytes{}, Processed{};
+
+        #if defined (__linux__)
+        // From the first shard, which signals the eventfd.
+        MPSCQueue_t<Sharedbuffer_t, 1024> Handoff{};
+        int Wakeup{ -1 };
+        std::atomic<uint64_t> Handedoff{}, Handoffdropped{};
+        #endif
+    };
+    static std::vector<Shard_t *> Shards{};
+
+    // Configurable via Config.json.
+    static uint32_t Maxdatagram{ 1472 }, Bundledelay{ 5 }, Transmitbacklog{ 1024 };
+    static uint32_t Maxmessage{ 1024 * 1024 };
+    constexpr size_t Transmitbatch = 32;
+
+    // For tuning the transmit-side.
+    static std::atomic<uint64_t> Framessent{}, Framesdropped{}, Senderrors{}, Wouldblock{};
+    static std::atomic<uint64_t> Totallatency{}, Maxlatency{}, Fragmented{};
+
+    // Needs to hold the lock, the oldest frames are kept when the backlog is full.
+    static void Enqueueframe(Blob_t &&Frame, uint32_t Group)
+    {
+        if (Transmitqueue.size() >= Transmitbacklog) [[unlikely]]
+        {
+            Framesdropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        Transmitqueue.emplace_back(std::move(Frame), Group, std::chrono::steady_clock::now());
+        Transmitsignal.notify_one();
+    }
+
+    // Needs to hold the lock, a lone message is sent without framing.
+    static void Flushbundle()
+    {
+        if (Bundlecount == 1) Enqueueframe(Bundle.substr(Framing::Bundleoverhead), Bundlegroup);
+        else if (Bundlecount > 1) Enqueueframe(std::move(Bundle), Bundlegroup);
+
+        Bundle.clear();
+        Bundlecount = 0;
+    }
+
+    // Needs to hold the lock, all fragments are queued or none; so a large message may exceed the backlog.
+    static void Enqueuefragments(const Blob_t &Packet, uint32_t Group)
+    {
+        if (Packet.size() > Maxmessage || Transmitqueue.size() >= Transmitbacklog) [[unlikely]]
+        {
+            Framesdropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        // The signature is unique per message, so it also identifies the fragments.
+        const auto MessageID = Hash::WW64(Packet.data(), std::min(Packet.size(), sizeof(Header_t::Signature)));
+        const auto Now = std::chrono::steady_clock::now();
+
+        for (auto &Frame : Framing::Fragment(Packet, MessageID, Maxdatagram))
+            Transmitqueue.emplace_back(std::move(Frame), Group, Now);
+
+        Fragmented.fetch_add(1, std::memory_order_relaxed);
+        Transmitsignal.notify_one();
+    }
 
     // Broadcast to the local network.
-    static void Publish(const Blob_t &Packet)
+    static void __cdecl Publish(const Blob_t &Message)
+    {
+        if (Message.size() < sizeof(Header_t)) [[unlikely]] return;
+
+        const auto Channel = getChannel(reinterpret_cast<const Header_t *>(Message.data())->Messagetype);
+        const auto Packet = Encodecompact(Message);
+        std::scoped_lock Guard(Transmitlock);
+        const auto Group = Channels[size_t(Channel)];
+
+        // Keep the order, even for messages that don't fit.
+        if (Packet.size() + Framing::Bundleoverhead > Maxdatagram)
+        {
+            Flushbundle();
+            return Enqueuefragments(Packet, Group);
+        }
+
+        // A bundle only goes to one group.
+        if (Group != Bundlegroup || Bundle.size() + sizeof(uint16_t) + Packet.size() > Maxdatagram) Flushbundle();
+        Bundlegroup = Group;
+
+        // A new bundle starts the timer.
+        if (Bundle.empty())
+        {
+            Bundledeadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(Bundledelay);
+            Transmitsignal.notify_one();
+        }
+
+        Framing::Appendbundle(Bundle, Packet);
+        ++Bundlecount;
+    }
+
+    // Returns the number of frames consumed, stops early if the socket would block.
+    #if defined (__linux__)
+    static size_t Sendframes(std::span<const Frame_t> Frames)
     {
-        // Try to put the packet onto the network.
-        for (uint8_t i = 0; i < 10; ++i)
+        std::array<mmsghdr, Transmitbatch> Messages{};
+        std::array<sockaddr_in, Transmitbatch> Targets{};
+        std::array<iovec, Transmitbatch> Vectors{};
+
+        for (size_t i = 0; i < Frames.size(); ++i)
+        {
+            Targets[i] = { AF_INET, cmp::toBig(Broadcastport), {{.S_addr = cmp::toBig(Frames[i].Group)}} };
+            Vectors[i] = { const_cast<uint8_t *>(Frames[i].Data.data()), Frames[i].Data.size() };
+            Messages[i].msg_hdr.msg_name = &Targets[i];
+            Messages[i].msg_hdr.msg_namelen = sizeof(Targets[i]);
+            Messages[i].msg_hdr.msg_iov = &Vectors[i];
+            Messages[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        const auto Result = sendmmsg(int(Broadcastsocket), Messages.data(), unsigned(Frames.size()), 0);
+        if (Result >= 0) [[likely]] return size_t(Result);
+        if (errno == EWOULDBLOCK || errno == EAGAIN) return 0;
+
+        // Skip the first frame so that we don't get stuck on it.
+        Senderrors.fetch_add(1, std::memory_order_relaxed);
+        return 1;
+    }
+    #else
+    static size_t Sendframes(std::span<const Frame_t> Frames)
+    {
+        for (size_t i = 0; i < Frames.size(); ++i)
         {
-            const auto Result = sendto(Broadcastsocket, (const char *)Packet.data(), (int)Packet.size(), NULL, (const sockaddr *)&Multicast, sizeof(Multicast));
-            if (Result == SOCKET_ERROR && WSAGetLastError() != WSAEWOULDBLOCK) [[unlikely]] return;
-            if (Result == static_cast<int>(Packet.size())) [[likely]] return;
+            const sockaddr_in Target{ AF_INET, cmp::toBig(Broadcastport), {{.S_addr = cmp::toBig(Frames[i].Group)}} };
+            const auto Result = sendto(Broadcastsocket, (const char *)Frames[i].Data.data(), (int)Frames[i].Data.size(), NULL, (const sockaddr *)&Target, sizeof(Target));
+            if (Result == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK) return i;
+            if (Result == SOCKET_ERROR) [[unlikely]] Senderrors.fetch_add(1, std::memory_order_relaxed);
         }
 
-        // Copy and try to send it in the background.
-        std::thread([](Blob_t Packet)
+        return Frames.size();
+    }
+    #endif
+
+    // Flushes the bundle once the deadline passes and drains the queue in order.
+    static void Transmitthread()
+    {
+        // Name this thread for easier debugging.
+        setThreadname("Ayria_LANTransmit");
+
+        std::vector<Frame_t> Batch{};
+        Batch.reserve(Transmitbatch);
+        uint32_t Backoff{};
+
+        while (true)
         {
-            while(true)
             {
-                const auto Result = sendto(Broadcastsocket, (const char *)Packet.data(), (int)Packet.size(), NULL, (const sockaddr *)&Multicast, sizeof(Multicast));
-                if (Result == SOCKET_ERROR && WSAGetLastError() != WSAEWOULDBLOCK) [[unlikely]] return;
-                if (Result == static_cast<int>(Packet.size())) [[likely]] return;
+                std::unique_lock Guard(Transmitlock);
+                Transmitsignal.wait(Guard, []() { return !Transmitqueue.empty() || !Bundle.empty(); });
+
+                // Only a pending bundle, wait for its deadline or new frames.
+                if (Transmitqueue.empty() && !Transmitsignal.wait_until(Guard, Bundledeadline, []() { return !Transmitqueue.empty(); }))
+                    Flushbundle();
+
+                while (!Transmitqueue.empty() && Batch.size() < Transmitbatch)
+                {
+                    Batch.emplace_back(std::move(Transmitqueue.front()));
+                    Transmitqueue.pop_front();
+                }
+            }
+
+            if (Batch.empty()) continue;
+            const auto Sent = Sendframes(Batch);
+            const auto Now = std::chrono::steady_clock::now();
+
+            for (size_t i = 0; i < Sent; ++i)
+            {
+                const auto Latency = uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(Now - Batch[i].Queued).count());
+                Totallatency.fetch_add(Latency, std::memory_order_relaxed);
+                if (Latency > Maxlatency.load(std::memory_order_relaxed)) Maxlatency.store(Latency, std::memory_order_relaxed);
+            }
+            Framessent.fetch_add(Sent, std::memory_order_relaxed);
+
+            // The socket is full, put the rest back in front and back off.
+            if (Sent < Batch.size())
+            {
+                {
+                    std::scoped_lock Guard(Transmitlock);
+                    Transmitqueue.insert(Transmitqueue.begin(), std::make_move_iterator(Batch.begin() + Sent), std::make_move_iterator(Batch.end()));
+                }
 
-                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                Wouldblock.fetch_add(1, std::memory_order_relaxed);
+                Backoff = std::clamp(Backoff * 2, 1U, 100U);
+                std::this_thread::sleep_for(std::chrono::milliseconds(Backoff));
             }
-        }, Packet).detach();
+            else Backoff = 0;
+
+            Batch.clear();
+        }
     }
 
-    // Every 100ms.
-    static void __cdecl Poll()
+    // Partially received messages, per receiving thread as the fragments of a sender arrive on the same socket.
+    static thread_local Framing::Reassembler_t Reassembly{};
+
+    // Configurable via Config.json.
+    static uint32_t Reassemblybudget{ 16 * 1024 * 1024 }, Reassemblytimeout{ 2000 };
+    static std::atomic<uint64_t> Reassembled{}, Reassemblyexpired{}, Reassemblyevicted{};
+
+    static void Reassemble(std::span<const uint8_t> Frame)
     {
-        // Check for data on the socket.
-        FD_SET ReadFD{}; FD_SET(Broadcastsocket, &ReadFD);
-        constexpr timeval Defaulttimeout{ NULL, 1 };
-        const auto Count{ ReadFD.fd_count };
-        auto Timeout{ Defaulttimeout };
+        const Framing::Reassembler_t::Limits_t Limits{ sizeof(Header_t), Maxmessage, Reassemblybudget, std::chrono::milliseconds(Reassemblytimeout) };
+        auto Result = Reassembly.Insert(Frame, Limits, std::chrono::steady_clock::now());
+
+        if (Result.Expired) Reassemblyexpired.fetch_add(Result.Expired, std::memory_order_relaxed);
+        if (Result.Evicted) Reassemblyevicted.fetch_add(Result.Evicted, std::memory_order_relaxed);
+        if (Result.Message.empty()) return;
+
+        // Complete, verify it like any other message.
+        Reassembled.fetch_add(1, std::memory_order_relaxed);
+        Receive(std::move(Result.Message));
+    }
+
+    // Bundled messages are views into the same datagram, which is released after the last one is stored.
+    static void Unbundle(Sharedbuffer_t Datagram)
+    {
+        if (Framing::isFragment(Datagram)) return Reassemble(Datagram);
 
-        // If there's any delayed packets, push them.
-        if (!Packetqueue.empty()) [[unlikely]]
+        // Plain messages start with a signature, collisions would fail verification anyway.
+        if (!Framing::isBundle(Datagram)) return Receive(std::move(Datagram));
+
+        Framing::Unbundle(Datagram, [&](size_t Offset, size_t Length)
         {
-            do
-            {
-                Publish(Packetqueue.front());
-                Packetqueue.pop();
+            Receive(Datagram.subspan(Offset, Length));
+        });
+    }
+
+    // IDs are hashed so that nearby IDs don't end up in nearby groups.
+    static uint32_t Groupaddress(uint64_t Key)
+    {
+        const auto Address = (Broadcastaddress & 0xFFFF0000) | (Hash::WW32(&Key, sizeof(Key)) & 0xFFFF);
+        return Address == Broadcastaddress ? Address ^ 1 : Address;
+    }
+
+    // Called when the game or mod changes, only the groups we need are joined.
+    static void __cdecl Rejoin()
+    {
+        Joined = { Global.GameID, Global.ModID };
+
+        std::array<uint32_t, 3> Wanted{ Broadcastaddress, Broadcastaddress, Broadcastaddress };
+        if (useChannels && Joined[0]) Wanted[size_t(Channel_t::Game)] = Wanted[size_t(Channel_t::Mod)] = Groupaddress(Joined[0]);
+        if (useChannels && Joined[0] && Joined[1]) Wanted[size_t(Channel_t::Mod)] = Groupaddress((uint64_t(Joined[0]) << 32) | Joined[1]);
+
+        // Leave first, so there's no window where we get both.
+        for (auto It = Memberships.begin(); It != Memberships.end();)
+        {
+            if (std::ranges::find(Wanted, *It) != Wanted.end()) { ++It; continue; }
 
-            } while (!Packetqueue.empty());
+            const ip_mreq Request{ {{.S_addr = cmp::toBig(*It)}} };
+            (void)setsockopt(Broadcastsocket, IPPROTO_IP, IP_DROP_MEMBERSHIP, (char *)&Request, sizeof(Request));
+            It = Memberships.erase(It);
         }
 
-        // Check if there's any data available for us.
-        if (!select(Count, &ReadFD, nullptr, nullptr, &Timeout)) [[likely]]
+        for (const auto Group : Wanted)
+        {
+            if (std::ranges::find(Memberships, Group) != Memberships.end()) continue;
+
+            const ip_mreq Request{ {{.S_addr = cmp::toBig(Group)}} };
+            if (setsockopt(Broadcastsocket, IPPROTO_IP, IP_ADD_MEMBERSHIP, (char *)&Request, sizeof(Request))) [[unlikely]]
+                Infoprint(va("LAN: could not join group %u.%u.%u.%u", Group >> 24, (Group >> 16) & 0xFF, (Group >> 8) & 0xFF, Group & 0xFF));
+            else
+                Memberships.emplace_back(Group);
+        }
+
+        std::scoped_lock Guard(Transmitlock);
+        Channels = Wanted;
+    }
+
+    // Same path as the socket, but without the capture.
+    void Ingest(Sharedbuffer_t Datagram)
+    {
+        Unbundle(std::move(Datagram));
+    }
+
+    // Receive-side tuning, configurable via Config.json.
+    static uint32_t Receivebuffer{ 1024 * 1024 }, Receivebatch{ 32 }, Receivethreads{ 1 };
+    static bool hasReceivethread{};
+
+    // Parsed on this shard's thread.
+    static void Process(Shard_t *Shard, Sharedbuffer_t &&Datagram)
+    {
+        Shard->Processed.fetch_add(1, std::memory_order_relaxed);
+        Unbundle(std::move(Datagram));
+    }
+
+    #if defined (__linux__)
+    // The first shard is the only one in the group, so it spreads the group's datagrams over the others by sender.
+    static void Dispatch(Shard_t *Shard, Sharedbuffer_t &&Datagram, const sockaddr_in &Sender)
+    {
+        if (Shard != Shards.front() || Shards.size() == 1) [[likely]] return Process(Shard, std::move(Datagram));
+
+        const auto Key = (uint64_t(Sender.sin_addr.s_addr) << 16) | Sender.sin_port;
+        const auto Target = Shards[Hash::WW32(&Key, sizeof(Key)) % Shards.size()];
+        if (Target == Shard) return Process(Shard, std::move(Datagram));
+
+        if (!Target->Handoff.try_push(std::move(Datagram))) [[unlikely]]
+        {
+            Target->Handoffdropped.fetch_add(1, std::memory_order_relaxed);
             return;
+        }
 
-        // Since we have data, allocate a small buffer.
-        constexpr int UDPSize = 0xFFE3;
-        const auto Buffer = (uint8_t *)alloca(UDPSize);
+        Target->Handedoff.fetch_add(1, std::memory_order_relaxed);
+        const uint64_t Signal{ 1 };
+        (void)!write(Target->Wakeup, &Signal, sizeof(Signal));
+    }
 
-        // Fetch all the data available.
+    // Sleeps until data is available, then drains up to Receivebatch datagrams per syscall.
+    static void Receivethread(Shard_t *Shard, int Epoll)
+    {
+        // Name this thread for easier debugging.
+        setThreadname("Ayria_LANReceive");
+
+        // Received buffers are handed off as-is, so only the consumed slots need a new one.
+        std::vector<Sharedbuffer_t> Buffers(Receivebatch);
+        std::vector<sockaddr_in> Senders(Receivebatch);
+        std::vector<mmsghdr> Messages(Receivebatch);
+        std::vector<iovec> Vectors(Receivebatch);
+
+        epoll_event Event{};
         while (true)
         {
-            // Fetch the whole packet at once, we don't care from where.
-            const auto Packetsize = recvfrom(Broadcastsocket, (char *)Buffer, UDPSize, NULL, nullptr, nullptr);
-            if (Packetsize < static_cast<int>(sizeof(Header_t))) [[unlikely]]
-                break;
-
-            // Check if this packet is a duplicate of ours.
-            const auto Header = reinterpret_cast<const Header_t *>(Buffer);
-            if (Header->Publickey == Global.Publickey) [[likely]]
+            // Interrupted by a signal.
+            if (epoll_wait(Epoll, &Event, 1, -1) <= 0) [[unlikely]]
                 continue;
 
-            // Set up the ranges we will care about.
-            const auto Signedpart = std::span(Buffer + 96, Packetsize - 96);
-            const auto Payload = std::span(Buffer + 108, Packetsize - 108);
+            // Handed off by the first shard, the counter is reset before draining so no signal is lost.
+            if (Shard->Wakeup != -1)
+            {
+                uint64_t Signals{};
+                (void)!read(Shard->Wakeup, &Signals, sizeof(Signals));
+                Shard->Handoff.drain([&](Sharedbuffer_t &&Datagram) { Process(Shard, std::move(Datagram)); });
+            }
+
+            while (true)
+            {
+                for (uint32_t i = 0; i < Receivebatch; ++i)
+                {
+                    Messages[i].msg_hdr.msg_name = &Senders[i];
+                    Messages[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+                    if (!Buffers[i].empty()) continue;
+
+                    Buffers[i] = Shard->Pool.Acquire();
+                    Vectors[i] = { Buffers[i].data(), Buffers[i].size() };
+                    Messages[i].msg_hdr.msg_iov = &Vectors[i];
+                    Messages[i].msg_hdr.msg_iovlen = 1;
+                }
+
+                const auto Count = recvmmsg(int(Shard->Socket), Messages.data(), Receivebatch, MSG_DONTWAIT, nullptr);
+                if (Count <= 0) break;
+
+                Shard->Datagrams.fetch_add(Count, std::memory_order_relaxed);
+                for (int i = 0; i < Count; ++i)
+                {
+                    // Larger than any MTU we send, so the buffer can be reused.
+                    if (Messages[i].msg_hdr.msg_flags & MSG_TRUNC) [[unlikely]] continue;
+
+                    Shard->Bytes.fetch_add(Messages[i].msg_len, std::memory_order_relaxed);
+                    Buffers[i].resize(Messages[i].msg_len);
+                    Capture::Record(Buffers[i]);
+                    Dispatch(Shard, std::move(Buffers[i]), Senders[i]);
+                }
+            }
+        }
+    }
+
+    // Extra socket in the SO_REUSEPORT group, returns 0 on failure.
+    static size_t Openshard()
+    {
+        constexpr sockaddr_in Localhost{ AF_INET, cmp::toBig(Broadcastport), {{.S_addr = cmp::toBig(INADDR_ANY)}} };
+        const int Enable{ 1 }, Disable{ 0 };
+
+        const auto Socket = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (Socket == -1) [[unlikely]] return 0;
+
+        // Not a member of the group, or every socket would get a copy.
+        int Error{};
+        Error |= setsockopt(Socket, SOL_SOCKET, SO_REUSEADDR, &Enable, sizeof(Enable));
+        Error |= setsockopt(Socket, SOL_SOCKET, SO_REUSEPORT, &Enable, sizeof(Enable));
+        Error |= setsockopt(Socket, IPPROTO_IP, IP_MULTICAST_ALL, &Disable, sizeof(Disable));
+        Error |= bind(Socket, (const sockaddr *)&Localhost, sizeof(Localhost));
+
+        if (Error) [[unlikely]]
+        {
+            closesocket(Socket);
+            return 0;
+        }
+
+        if (Receivebuffer) (void)setsockopt(Socket, SOL_SOCKET, SO_RCVBUF, &Receivebuffer, sizeof(Receivebuffer));
+        return size_t(Socket);
+    }
+
+    // Returns the epoll for the thread or -1, the extra shards also wait for handoffs from the first.
+    static int Preparereceiving(Shard_t *Shard, bool isFirst)
+    {
+        epoll_event Event{ .events = EPOLLIN };
+        const auto Epoll = epoll_create1(EPOLL_CLOEXEC);
+        if (Epoll == -1) [[unlikely]] return -1;
+
+        if (!isFirst) Shard->Wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epoll_ctl(Epoll, EPOLL_CTL_ADD, int(Shard->Socket), &Event) ||
+            (!isFirst && (Shard->Wakeup == -1 || epoll_ctl(Epoll, EPOLL_CTL_ADD, Shard->Wakeup, &Event)))) [[unlikely]]
+        {
+            if (Shard->Wakeup != -1) close(Shard->Wakeup);
+            Shard->Wakeup = -1;
+            close(Epoll);
+            return -1;
+        }
 
-            // Validate the integrity of the packet.
-            if (!qDSA::Verify(Header->Publickey, Header->Signature, Signedpart)) [[unlikely]]
+        return Epoll;
+    }
+    #else
+    // Sleeps in select until data is available.
+    static void Receivethread(Shard_t *Shard)
+    {
+        // Name this thread for easier debugging.
+        setThreadname("Ayria_LANReceive");
+
+        while (true)
+        {
+            fd_set ReadFD{}; FD_ZERO(&ReadFD); FD_SET(Shard->Socket, &ReadFD);
+            if (select(int(Shard->Socket) + 1, &ReadFD, nullptr, nullptr, nullptr) <= 0) [[unlikely]]
                 continue;
 
-            // Forward to DB.
-            Synchronization::Storemessage(Header->Signature, Header->Publickey, Header->Messagetype, Header->Timestamp, Payload);
+            while (true)
+            {
+                auto Buffer = Shard->Pool.Acquire();
+                const auto Packetsize = recvfrom(Shard->Socket, (char *)Buffer.data(), int(Buffer.size()), NULL, nullptr, nullptr);
+                if (Packetsize <= 0) break;
+
+                Shard->Datagrams.fetch_add(1, std::memory_order_relaxed);
+                Shard->Bytes.fetch_add(Packetsize, std::memory_order_relaxed);
+                Buffer.resize(Packetsize);
+                Capture::Record(Buffer);
+                Process(Shard, std::move(Buffer));
+            }
+        }
+    }
+
+    // Windows has no SO_REUSEPORT, so there's only ever the one.
+    static bool Startreceiving(Shard_t *Shard)
+    {
+        std::thread(Receivethread, Shard).detach();
+        return true;
+    }
+    #endif
+
+    // From a few local sockets, so that the kernel has different flows to spread; unicast by default, or to the base group.
+    // Uses our own key, so the packets are dropped right before verification.
+    static void Benchmark(size_t Count, size_t Size, size_t Senders, bool Multicast)
+    {
+        Blob_t Packet(Size, 0xAA);
+        reinterpret_cast<Header_t *>(Packet.data())->Publickey = Global.Publickey;
+
+        // Counted once parsed, as the group is received by one socket and parsed by all.
+        const auto Processed = []()
+        {
+            uint64_t Total{};
+            for (const auto Shard : Shards) Total += Shard->Processed.load(std::memory_order_relaxed);
+            return Total;
+        };
+
+        std::vector<std::pair<uint64_t, uint64_t>> Before{};
+        for (const auto Shard : Shards) Before.emplace_back(Shard->Datagrams.load(), Shard->Processed.load());
+        const auto Baseline = Processed();
+        const auto Start = std::chrono::steady_clock::now();
+
+        std::vector<std::thread> Threads{};
+        for (size_t Sender = 0; Sender < Senders; ++Sender)
+        {
+            Threads.emplace_back([&, Sender]()
+            {
+                const sockaddr_in Target{ AF_INET, cmp::toBig(Broadcastport), {{.S_addr = cmp::toBig(Multicast ? Broadcastaddress : INADDR_LOOPBACK)}} };
+                const auto Socket = socket(AF_INET, SOCK_DGRAM, 0);
+
+                for (size_t i = Sender; i < Count; i += Senders)
+                    (void)sendto(Socket, (const char *)Packet.data(), (int)Packet.size(), NULL, (const sockaddr *)&Target, sizeof(Target));
+
+                closesocket(Socket);
+            });
+        }
+        for (auto &Thread : Threads) Thread.join();
+
+        // Until the receivers have drained their sockets.
+        auto Last = Processed();
+        auto Finished = std::chrono::steady_clock::now();
+        while (true)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            if (const auto Current = Processed(); Current != Last)
+            {
+                Finished = std::chrono::steady_clock::now();
+                Last = Current;
+            }
+            else break;
         }
 
+        const auto Seconds = std::max(std::chrono::duration<double>(Finished - Start).count(), 1e-6);
+        const auto Total = Last - Baseline;
+        Infoprint(va("LAN benchmark: %llu / %zu %s datagrams of %zu bytes in %.3f sec, %.0f datagrams/sec over %zu threads",
+                     Total, Count, Multicast ? "multicast" : "unicast", Size, Seconds, double(Total) / Seconds, Shards.size()));
+
+        for (size_t i = 0; i < Shards.size(); ++i)
+            Infoprint(va("    Socket %zu: %llu received, %llu parsed", i, Shards[i]->Datagrams.load() - Before[i].first, Shards[i]->Processed.load() - Before[i].second));
+    }
+
+    // Every 100ms, fallback if the receive thread could not be started.
+    static void __cdecl Poll()
+    {
+        // Check for data on the socket.
+        fd_set ReadFD{}; FD_ZERO(&ReadFD); FD_SET(Broadcastsocket, &ReadFD);
+        constexpr timeval Defaulttimeout{ NULL, 1 };
+        const auto Count{ int(Broadcastsocket) + 1 };
+        auto Timeout{ Defaulttimeout };
+
+        // Check if there's any data available for us.
+        if (!select(Count, &ReadFD, nullptr, nullptr, &Timeout)) [[likely]]
+            return;
+
+        // Fetch all the data available.
+        while (true)
+        {
+            // Fetch the whole packet at once, we don't care from where.
+            auto Buffer = Receivepool.Acquire();
+            const auto Packetsize = recvfrom(Broadcastsocket, (char *)Buffer.data(), int(Buffer.size()), NULL, nullptr, nullptr);
+            if (Packetsize <= 0) [[unlikely]]
+                break;
 
+            Shards.front()->Datagrams.fetch_add(1, std::memory_order_relaxed);
+            Shards.front()->Bytes.fetch_add(Packetsize, std::memory_order_relaxed);
+            Buffer.resize(Packetsize);
+            Capture::Record(Buffer);
+            Process(Shards.front(), std::move(Buffer));
+        }
     }
 
     // On startup.
@@ -102,10 +590,16 @@ namespace Backend::Network::LANNetworking
     {
         constexpr sockaddr_in Localhost{ AF_INET, cmp::toBig(Broadcastport), {{.S_addr = cmp::toBig(INADDR_ANY)}} };
         constexpr ip_mreq Request{ {{.S_addr = cmp::toBig(Broadcastaddress)}} };
+        const auto &Settings = Config::getSettings();
         unsigned long Argument{ 1 };
         unsigned long Error{ 0 };
         WSADATA Unused;
 
+        // Sharding needs SO_REUSEPORT on every socket in the group, so this is decided before binding.
+        #if defined (__linux__)
+        Receivethreads = std::clamp(Settings.value<uint32_t>("LANReceivethreads", Receivethreads), 1U, 16U);
+        #endif
+
         // We only need WS 1.1, no need for more.
         (void)WSAStartup(MAKEWORD(1, 1), &Unused);
         Broadcastsocket = socket(AF_INET, SOCK_DGRAM, 0);
@@ -115,6 +609,13 @@ namespace Backend::Network::LANNetworking
         // Join the multicast group, reuse address if multiple clients are on the same PC (mainly for developers).
         Error |= setsockopt(Broadcastsocket, IPPROTO_IP, IP_ADD_MEMBERSHIP, (char *)&Request, sizeof(Request));
         Error |= setsockopt(Broadcastsocket, SOL_SOCKET, SO_REUSEADDR, (char *)&Argument, sizeof(Argument));
+        #if defined (__linux__)
+        if (Receivethreads > 1) Error |= setsockopt(Broadcastsocket, SOL_SOCKET, SO_REUSEPORT, (char *)&Argument, sizeof(Argument));
+
+        // Linux delivers the groups joined by any socket on the port by default, i.e. other clients games.
+        const int Disable{ 0 };
+        Error |= setsockopt(Broadcastsocket, IPPROTO_IP, IP_MULTICAST_ALL, &Disable, sizeof(Disable));
+        #endif
         Error |= bind(Broadcastsocket, (sockaddr *)&Localhost, sizeof(Localhost));
 
         // TODO(tcn): Proper error handling.
@@ -125,26 +626,103 @@ namespace Backend::Network::LANNetworking
             return;
         }
 
-        // Add periodic tasks.
-        Enqueuetask(Poll, 100);
-    }
+        // Optional tuning of the transmit-side.
+        Maxdatagram = std::clamp(Settings.value<uint32_t>("LANMTU", Maxdatagram), 576U, uint32_t(Receivepool.buffersize()));
+        Bundledelay = Settings.value<uint32_t>("Bundledelay", Bundledelay);
+        Transmitbacklog = std::max(Settings.value<uint32_t>("LANTransmitbacklog", Transmitbacklog), 1U);
 
-    // Register initialization to run on startup.
-    struct Startup_t { Startup_t() { Backend::Backgroundtasks::addStartuptask(Initialize); } } Startup{};
-}
+        // Both sides need to agree on the largest message, the budget needs to hold at least one.
+        Maxmessage = std::clamp(Settings.value<uint32_t>("LANMaxmessage", Maxmessage), 0xFFE3U, 16U * 1024 * 1024);
+        Reassemblybudget = std::max(Settings.value<uint32_t>("LANReassemblybudget", Reassemblybudget), Maxmessage);
+        Reassemblytimeout = std::max(Settings.value<uint32_t>("LANReassemblytimeout", Reassemblytimeout), 100U);
+        std::thread(Transmitthread).detach();
 
-namespace Backend::Network
-{
-    // Publish a payload to the network.
-    void PublishLAN(const Blob_t &Packet, bool Delayed)
-    {
-        if (Delayed)
+        // Let the user check if the network keeps up.
+        static constexpr auto Printstats = [](int, const char **)
         {
-            LANNetworking::Packetqueue.push(Packet);
-        }
-        else
+            const auto Sent = Framessent.load();
+            Infoprint(va("LAN transmit: %llu sent, %llu dropped, %llu errors, %llu would-block, %llu us avg / %llu us max latency",
+                         Sent, Framesdropped.load(), Senderrors.load(), Wouldblock.load(), Sent ? Totallatency.load() / Sent : 0, Maxlatency.load()));
+            Infoprint(va("LAN fragments: %llu messages split, %llu reassembled, %llu expired, %llu evicted",
+                         Fragmented.load(), Reassembled.load(), Reassemblyexpired.load(), Reassemblyevicted.load()));
+
+            for (size_t i = 0; i < Shards.size(); ++i)
+            {
+                const auto Pool = Shards[i]->Pool.getStatistics();
+                Infoprint(va("LAN receive %zu: %llu datagrams, %llu bytes, %llu parsed, %llu pooled buffers, %llu heap fallbacks, %zu available",
+                             i, Shards[i]->Datagrams.load(), Shards[i]->Bytes.load(), Shards[i]->Processed.load(), Pool.Acquired, Pool.Fallbacks, Pool.Available));
+
+                #if defined (__linux__)
+                if (i) Infoprint(va("    %llu handed off, %llu dropped with a full handoff", Shards[i]->Handedoff.load(), Shards[i]->Handoffdropped.load()));
+                #endif
+            }
+        };
+        Communication::Console::addCommand(u8"LANstats", Printstats);
+
+        // LANbenchmark [Datagrams] [Size] [Senders] [Multicast]
+        static constexpr auto Benchmarkcommand = [](int Argc, const char **Argv)
+        {
+            const auto Count = Argc > 0 ? std::strtoull(Argv[0], nullptr, 10) : 100000ULL;
+            const auto Size = Argc > 1 ? std::strtoull(Argv[1], nullptr, 10) : 256ULL;
+            const auto Senders = Argc > 2 ? std::strtoull(Argv[2], nullptr, 10) : 4ULL;
+            const auto Multicast = Argc > 3 ? std::strtoull(Argv[3], nullptr, 10) : 0ULL;
+
+            Benchmark(size_t(Count), std::clamp(size_t(Size), sizeof(Header_t), size_t(Maxdatagram)), std::clamp(size_t(Senders), size_t(1), size_t(64)), Multicast != 0);
+        };
+        Communication::Console::addCommand(u8"LANbenchmark", Benchmarkcommand);
+
+        // Bursts should not overflow the socket between reads.
+        Receivebuffer = Settings.value<uint32_t>("LANReceivebuffer", Receivebuffer);
+        Receivebatch = std::clamp(Settings.value<uint32_t>("LANReceivebatch", Receivebatch), 1U, 256U);
+        if (Receivebuffer) (void)setsockopt(Broadcastsocket, SOL_SOCKET, SO_RCVBUF, (char *)&Receivebuffer, sizeof(Receivebuffer));
+
+        Shards.emplace_back(new Shard_t{ Broadcastsocket, Receivepool });
+
+        // The first shard hands off to the others by index, so the list is complete before any thread starts.
+        #if defined (__linux__)
+        std::vector<int> Epolls{ Preparereceiving(Shards.front(), true) };
+        for (uint32_t i = 1; Epolls.front() != -1 && i < Receivethreads; ++i)
         {
-            LANNetworking::Publish(Packet);
+            const auto Socket = Openshard();
+            const auto Shard = Socket ? new Shard_t{ Socket, *new Receivepool_t() } : nullptr;
+            const auto Epoll = Shard ? Preparereceiving(Shard, false) : -1;
+
+            if (Epoll == -1) [[unlikely]]
+            {
+                // Nothing has been handed out from the pool yet.
+                if (Shard)
+                {
+                    closesocket(Socket);
+                    delete &Shard->Pool;
+                    delete Shard;
+                }
+
+                Infoprint(va("LAN: could not open receive socket %u, continuing with %zu.", i, Shards.size()));
+                break;
+            }
+
+            Shards.emplace_back(Shard);
+            Epolls.emplace_back(Epoll);
         }
+
+        hasReceivethread = Epolls.front() != -1;
+        for (size_t i = 0; hasReceivethread && i < Shards.size(); ++i)
+            std::thread(Receivethread, Shards[i], Epolls[i]).detach();
+        #else
+        hasReceivethread = Startreceiving(Shards.front());
+        #endif
+
+        // Per-game groups, disable if there are older clients on the network that only use the base group.
+        Memberships.emplace_back(Broadcastaddress);
+        useChannels = Settings.value<bool>("LANChannels", useChannels);
+        onMemorywrite(&Global.GameID, Joined.data(), sizeof(Joined), Rejoin);
+        Rejoin();
+
+        // Add periodic tasks.
+        if (!hasReceivethread) Enqueuetask(Poll, 100);
+        Register(Scope_t::LAN, Publish);
     }
+
+    // Register initialization to run on startup.
+    struct Startup_t { Startup_t() { Backend::Backgroundtasks::addStartuptask(Initialize); } } Startup{};
 }
@@ -0,0 +1,381 @@
+/*
+    Initial author: Convery (tcn@ayria.se)
+    Started: 2023-03-28
+    License: MIT
+
+    Routes packets between the backend and whatever transports are registered.
+
+    Compact (v2) header, see Framing.hpp. Receivers rebuild the v1 header before verification,
+    as that is what the signature covers. Unframed packets are still accepted as v1.
+    Senders announce their epoch in a signed message, as the frame's epoch is not covered by the signature.
+*/
+
+#include <Ayria.hpp>
+
+namespace Backend::Network
+{
+    // Append-only so that publishing needs no lock, the simulator may register after startup.
+    struct Transportlist_t
+    {
+        std::array<std::atomic<Transport_t>, 8> Entries{};
+        std::atomic<size_t> Count{};
+    };
+    static std::array<Transportlist_t, 2> Transports{};
+    static Spinlock_t Registerlock{};
+
+    // Sent from the background thread on the next tick.
+    static std::queue<std::pair<Scope_t, Blob_t>> Delayedqueue{};
+    static Spinlock_t Delayedlock{};
+
+    // Sent with the full key, as the peer we ask may be missing ours as well.
+    constexpr uint32_t Keyrequesttype = Hash::WW32("Network::Keyrequest");
+
+    // One per channel, as receivers may not share them all.
+    constexpr std::array<uint32_t, 3> Announcetypes{ Hash::WW32("Network::Announce"), Hash::WW32("Network::Announce::Game"), Hash::WW32("Network::Announce::Mod") };
+
+    // Senders we have a verified announcement from.
+    struct Senderkey_t
+    {
+        qDSA::Publickey_t Publickey;
+        int64_t Epoch, Announced;
+        uint32_t Lastused;
+    };
+    static Hashmap<uint64_t, Senderkey_t> Senderkeys{};
+    static Spinlock_t Senderlock{};
+    constexpr size_t Maxsenders = 4096;
+
+    // Unknown senders are asked for from the background thread, as the request is signed; a few per second in total.
+    static Hashmap<uint64_t, uint32_t> Keyrequests{};
+    static Hashset<uint64_t> Pendingrequests{};
+    constexpr size_t Maxpendingrequests = 64;
+    constexpr uint32_t Keyrequestinterval = 250;
+
+    // Our own epoch, announced periodically and on request; frames use the full key until the channel has had one.
+    static int64_t Localepoch{};
+    static std::array<uint32_t, 3> Lastannounce{};
+    static std::array<bool, 3> isAnnounced{};
+    static uint32_t Announceperiod{ 10000 };
+    static std::atomic<uint8_t> Forceannounce{ 0x7 };
+    static Spinlock_t Epochlock{};
+
+    // Set by the services on startup.
+    static Hashmap<uint32_t, Channel_t> Routes{};
+    static Spinlock_t Routelock{};
+
+    // Configurable via Config.json, disable for networks with older clients.
+    static bool useCompactheader{ true };
+
+    // Replays run against a scratch DB, so nothing from them should reach the network.
+    static bool isMuted{};
+
+    // For tuning the header.
+    static std::atomic<uint64_t> Compactsent{}, Compactreceived{}, Keymisses{}, Savedbytes{};
+
+    // Same as the ShortID in the Account table.
+    static uint64_t getShortID(const qDSA::Publickey_t &Publickey)
+    {
+        return (Hash::WW64(Publickey) << 32) | Hash::WW32(Publickey);
+    }
+
+    static void Publish(Scope_t Scope, const Blob_t &Packet)
+    {
+        if (isMuted) [[unlikely]] return;
+
+        const auto &List = Transports[size_t(Scope)];
+        const auto Count = List.Count.load(std::memory_order_acquire);
+
+        for (size_t i = 0; i < Count; ++i)
+        {
+            List.Entries[i].load(std::memory_order_relaxed)(Packet);
+        }
+    }
+
+    // Every 100ms.
+    static void __cdecl Flushdelayed()
+    {
+        decltype(Delayedqueue) Packets{};
+        {
+            std::scoped_lock Guard(Delayedlock);
+            if (Delayedqueue.empty()) [[likely]] return;
+            Packets.swap(Delayedqueue);
+        }
+
+        while (!Packets.empty())
+        {
+            Publish(Packets.front().first, Packets.front().second);
+            Packets.pop();
+        }
+    }
+
+    // Only our own packets can refer to an announced key, others are forwarded with the full key.
+    Blob_t Encodecompact(const Blob_t &Packet)
+    {
+        if (!useCompactheader || Packet.size() < sizeof(Header_t)) return Packet;
+
+        const auto Header = reinterpret_cast<const Header_t *>(Packet.data());
+        Framing::Compactheader_t Compact{ Framing::Fullkey, Header->Signature, Header->Publickey, getShortID(Header->Publickey),
+                                          Header->Timestamp, Header->Messagetype, Header->Timestamp };
+
+        if (Header->Publickey == Global.Publickey && Header->Messagetype != Keyrequesttype)
+        {
+            const auto Channel = size_t(getChannel(Header->Messagetype));
+            const auto isAnnouncement = std::ranges::find(Announcetypes, Header->Messagetype) != Announcetypes.end();
+            std::scoped_lock Guard(Epochlock);
+
+            // The flag is informational, receivers learn the epoch from the signed payload.
+            if (isAnnouncement) Compact.Flags = Framing::Fullkey | Framing::Announce;
+
+            // Retransmissions may be older than the epoch.
+            else if (Localepoch && isAnnounced[Channel] && Header->Timestamp >= Localepoch)
+            {
+                Compact.Epoch = Localepoch;
+                Compact.Flags = 0;
+            }
+        }
+
+        // The full key with a large epoch can be larger than v1.
+        auto Result = Framing::Encodecompact(Compact, std::span(Packet).subspan(sizeof(Header_t)));
+        if (Result.size() >= Packet.size()) return Packet;
+        Savedbytes.fetch_add(Packet.size() - Result.size(), std::memory_order_relaxed);
+
+        Compactsent.fetch_add(1, std::memory_order_relaxed);
+        return Result;
+    }
+
+    // Rebuild the v1 packet, returns empty if malformed or the sender is unknown.
+    // The v1 header is larger than the compact one, so it can't be rebuilt in front of the payload without overwriting
+    // the previous message in a bundle, which verification may still be reading; hence the copy.
+    static Sharedbuffer_t Decodecompact(const Sharedbuffer_t &Frame)
+    {
+        Framing::Compactheader_t Header{};
+        std::span<const uint8_t> Payload{};
+        bool isMissing{};
+
+        const auto Lookup = [&](uint64_t ShortID, qDSA::Publickey_t &Publickey, int64_t &Epoch)
+        {
+            const auto Now = GetTickCount();
+            std::scoped_lock Guard(Senderlock);
+
+            if (const auto Entry = Senderkeys.find(ShortID); Entry != Senderkeys.end())
+            {
+                Publickey = Entry->second.Publickey;
+                Epoch = Entry->second.Epoch;
+                Entry->second.Lastused = Now;
+                return true;
+            }
+
+            // Ask at most once per second per sender, reconciliation recovers the packet later.
+            if (Keyrequests.size() >= Maxsenders && !Keyrequests.contains(ShortID)) [[unlikely]] Keyrequests.erase(Keyrequests.begin());
+            auto &Last = Keyrequests[ShortID];
+            if ((Now - Last) >= 1000 && Pendingrequests.size() < Maxpendingrequests)
+            {
+                Pendingrequests.insert(ShortID);
+                Last = Now;
+            }
+
+            isMissing = true;
+            return false;
+        };
+
+        if (!Framing::Decodecompact(Frame, Header, Payload, Lookup))
+        {
+            if (isMissing) Keymisses.fetch_add(1, std::memory_order_relaxed);
+            return {};
+        }
+
+        auto Packet = Sharedbuffer_t::Allocate(sizeof(Header_t) + Payload.size());
+        const auto Output = reinterpret_cast<Header_t *>(Packet.data());
+        Output->Signature = Header.Signature;
+        Output->Publickey = Header.Publickey;
+        Output->Messagetype = Header.Messagetype;
+        Output->Timestamp = Header.Timestamp;
+        std::memcpy(Packet.data() + sizeof(Header_t), Payload.data(), Payload.size());
+
+        Compactreceived.fetch_add(1, std::memory_order_relaxed);
+        return Packet;
+    }
+
+    // Every 250ms, one request at a time as anyone can send frames with a new ShortID.
+    static void __cdecl Sendkeyrequests()
+    {
+        uint64_t ShortID{};
+        {
+            std::scoped_lock Guard(Senderlock);
+            if (Pendingrequests.empty()) [[likely]] return;
+
+            ShortID = *Pendingrequests.begin();
+            Pendingrequests.erase(Pendingrequests.begin());
+        }
+
+        PublishLAN(Synchronization::Createmessage(Keyrequesttype, Bytebuffer_t(&ShortID, sizeof(ShortID))));
+    }
+
+    // Every second, on the channels where the period passed or someone asked for our key.
+    static void __cdecl Announce()
+    {
+        if (!useCompactheader) return;
+
+        const auto Forced = Forceannounce.exchange(0);
+        const auto Now = GetTickCount();
+        std::array<bool, 3> isDue{};
+        int64_t Epoch{};
+
+        {
+            std::scoped_lock Guard(Epochlock);
+            if (!Localepoch) Localepoch = (getTimestamp() & ~Envelopemask) | Envelopemarker;
+            Epoch = Localepoch;
+
+            for (size_t i = 0; i < isDue.size(); ++i)
+            {
+                isDue[i] = (Forced & (1 << i)) || (Now - Lastannounce[i]) >= Announceperiod;
+                if (isDue[i]) Lastannounce[i] = Now;
+            }
+        }
+
+        for (size_t i = 0; i < isDue.size(); ++i)
+        {
+            if (!isDue[i]) continue;
+            PublishLAN(Synchronization::Createmessage(Announcetypes[i], Bytebuffer_t(&Epoch, sizeof(Epoch))));
+
+            std::scoped_lock Guard(Epochlock);
+            isAnnounced[i] = true;
+        }
+    }
+
+    // Verified, so the epoch is the senders own; older announcements are replays.
+    static void __cdecl onAnnounce(const qDSA::Publickey_t &Publickey, int64_t, int64_t Timestamp, const Bytebuffer_t &Payload)
+    {
+        if (Payload.size() != sizeof(int64_t)) [[unlikely]] return;
+
+        int64_t Epoch{};
+        std::memcpy(&Epoch, Payload.data(), sizeof(Epoch));
+
+        const auto ShortID = getShortID(Publickey);
+        const auto Now = GetTickCount();
+        std::scoped_lock Guard(Senderlock);
+
+        const auto Entry = Senderkeys.find(ShortID);
+        if (Entry != Senderkeys.end() && getTime(Timestamp) <= Entry->second.Announced) return;
+
+        // Evict the least recently used, so new senders can't push out the active ones.
+        if (Entry == Senderkeys.end() && Senderkeys.size() >= Maxsenders) [[unlikely]]
+            Senderkeys.erase(std::ranges::min_element(Senderkeys, {}, [&](const auto &Item) { return Now - Item.second.Lastused; }));
+
+        Senderkeys[ShortID] = { Publickey, Epoch, getTime(Timestamp), Now };
+    }
+
+    // Someone missed our announcement.
+    static void __cdecl onKeyrequest(const qDSA::Publickey_t &, int64_t, int64_t, const Bytebuffer_t &Payload)
+    {
+        if (Payload.size() != sizeof(uint64_t)) [[unlikely]] return;
+
+        uint64_t ShortID{};
+        std::memcpy(&ShortID, Payload.data(), sizeof(ShortID));
+        if (ShortID == getShortID(Global.Publickey)) Forceannounce.store(0x7);
+    }
+
+    // Unrouted types go to the base channel.
+    void Route(uint32_t Messagetype, Channel_t Channel)
+    {
+        std::scoped_lock Guard(Routelock);
+        Routes[Messagetype] = Channel;
+    }
+    Channel_t getChannel(uint32_t Messagetype)
+    {
+        std::scoped_lock Guard(Routelock);
+        const auto Entry = Routes.find(Messagetype);
+        return Entry == Routes.end() ? Channel_t::Base : Entry->second;
+    }
+
+    // Transports are never removed, so they need to check if they are still active.
+    void Register(Scope_t Scope, Transport_t Transport)
+    {
+        std::scoped_lock Guard(Registerlock);
+        auto &List = Transports[size_t(Scope)];
+
+        const auto Count = List.Count.load(std::memory_order_relaxed);
+        assert(Count < List.Entries.size());
+        if (Count >= List.Entries.size()) [[unlikely]] return;
+
+        List.Entries[Count].store(Transport, std::memory_order_relaxed);
+        List.Count.store(Count + 1, std::memory_order_release);
+    }
+
+    // Transports hand complete messages back here.
+    void Receive(Sharedbuffer_t &&Message)
+    {
+        if (Framing::isCompact(Message)) Message = Decodecompact(Message);
+
+        if (Message.size() < sizeof(Header_t)) [[unlikely]]
+            return;
+
+        // Check if this packet is a duplicate of ours.
+        const auto Header = reinterpret_cast<const Header_t *>(Message.data());
+        if (Header->Publickey == Global.Publickey) [[likely]]
+            return;
+
+        // A newer envelope than we understand, the payload would be misread.
+        if (!isSupported(Header->Timestamp)) [[unlikely]]
+            return;
+
+        // Nothing here would use it, so skip the verification; the sequence is still counted, or it would be NACKed as lost.
+        if (!Interests::isWanted(Header->Messagetype))
+        {
+            const auto Payload = std::span<const uint8_t>(Message.data() + sizeof(Header_t), Message.size() - sizeof(Header_t));
+            return Reliability::Skip(Header->Publickey, Synchronization::getSequence(Header->Timestamp, Payload));
+        }
+
+        // Verified and forwarded to the DB by the pool.
+        Capture::Trace(Capture::Stage_t::Received, Header->Signature);
+        Verification::Enqueue(std::move(Message));
+    }
+
+    // Publish a payload to the network.
+    void PublishLAN(const Blob_t &Packet, bool Delayed)
+    {
+        if (!Delayed) return Publish(Scope_t::LAN, Packet);
+
+        std::scoped_lock Guard(Delayedlock);
+        Delayedqueue.emplace(Scope_t::LAN, Packet);
+    }
+    void PublishWAN(const Blob_t &Packet, bool Delayed)
+    {
+        if (!Delayed) return Publish(Scope_t::WAN, Packet);
+
+        std::scoped_lock Guard(Delayedlock);
+        Delayedqueue.emplace(Scope_t::WAN, Packet);
+    }
+
+    // On startup.
+    static void __cdecl Initialize()
+    {
+        const auto &Settings = Config::getSettings();
+        useCompactheader = Settings.value<bool>("Compactheader", useCompactheader);
+        isMuted = Settings.value<bool>("Replaymode", isMuted);
+        Announceperiod = std::max(Settings.value<uint32_t>("Keyannounceperiod", Announceperiod), 1000U);
+
+        Synchronization::Register("Network::Keyrequest", Synchronization::Retention_t{ .Ephemeral = true });
+        Synchronization::Register("Network::Keyrequest", onKeyrequest);
+        Enqueuetask(Sendkeyrequests, Keyrequestinterval);
+        Enqueuetask(Flushdelayed, 100);
+
+        for (const auto Type : Announcetypes)
+        {
+            Synchronization::Register(Type, Synchronization::Retention_t{ .Ephemeral = true });
+            Synchronization::Register(Type, onAnnounce);
+        }
+        Route(Announcetypes[size_t(Channel_t::Game)], Channel_t::Game);
+        Route(Announcetypes[size_t(Channel_t::Mod)], Channel_t::Mod);
+        Enqueuetask(Announce, 1000);
+
+        static constexpr auto Printstats = [](int, const char **)
+        {
+            Infoprint(va("Compact header: %llu sent, %llu received, %llu bytes saved, %llu unknown senders",
+                         Compactsent.load(), Compactreceived.load(), Savedbytes.load(), Keymisses.load()));
+        };
+        Communication::Console::addCommand(u8"Headerstats", Printstats);
+    }
+
+    // Register initialization to run on startup.
+    struct Startup_t { Startup_t() { Backgroundtasks::addStartuptask(Initialize); } } Startup{};
+}
@@ -0,0 +1,299 @@
+/*
+    Initial author: Convery (tcn@ayria.se)
+    Started: 2023-03-20
+    License: MIT
+
+    Anti-entropy between LAN clients.
+    Each client periodically broadcasts a digest (count + XOR of hashed signatures) per time-bucket.
+    Mismatching buckets are answered with the packet-IDs in that bucket, and whoever has packets
+    that are not in the list re-broadcasts them as-is; the signatures are still valid.
+    Types that any client filters out are not compared, see Interests.cpp.
+*/
+
+#include <Ayria.hpp>
+
+namespace Backend::Reconciliation
+{
+    #pragma pack(push, 1)
+    struct Bucketdigest_t
+    {
+        int64_t Bucket;
+        uint32_t Count;
+        uint64_t Digest;
+    };
+    struct Inventoryheader_t
+    {
+        int64_t Bucket;
+        uint64_t Low, High;
+    };
+    #pragma pack(pop)
+
+    // IDs per inventory message, the range [Low, High] they cover lets the receiver compare partial lists.
+    constexpr size_t Inventorysize = 1024;
+    constexpr size_t Retransmitlimit = 256;
+
+    // Configurable via Config.json.
+    static uint32_t Reconcileperiod{ 10000 }, Reconcilewindow{ 15 };
+    constexpr int64_t Bucketwidth = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::minutes(1)).count();
+
+    // For checking convergence.
+    struct Bucketstats_t
+    {
+        uint32_t Mismatchsince, Lastinventory, Convergencetime;
+        uint64_t Bytessent, Bytesreceived;
+    };
+    static Hashmap<int64_t, Bucketstats_t> Bucketstats{};
+    static uint64_t Digestbytes{}, Retransmitted{}, Throttled{};
+
+    // Several peers answer the same digest, so each packet is re-broadcast once per period and each requester gets a limited share.
+    static Hashmap<uint64_t, uint32_t> Recentlysent{};
+    struct Requester_t
+    {
+        uint32_t Windowstart, Inventories, Packets;
+    };
+    static Hashmap<qDSA::Publickey_t, Requester_t, decltype(WW64::Hash)> Requesters{};
+    constexpr size_t Maxinventories = 64, Maxrequesters = 1024, Maxrecentlysent = 64 * 1024;
+
+    // Wall-clock, so that clients agree on the buckets regardless of uptime.
+    static int64_t Currentbucket()
+    {
+        return Network::getTimestamp() / Bucketwidth;
+    }
+
+    // Types that some client filters are left out, it would never store them and the digests would never match.
+    static bool isShared(Hashmap<uint32_t, bool> &Cache, uint32_t Messagetype)
+    {
+        const auto Entry = Cache.find(Messagetype);
+        if (Entry != Cache.end()) [[likely]] return Entry->second;
+
+        return Cache[Messagetype] = Network::Interests::isShared(Messagetype);
+    }
+
+    // Only complete buckets are compared, the current one is still being filled.
+    static Hashmap<int64_t, Bucketdigest_t> Localdigests(int64_t First, int64_t Last)
+    {
+        Hashmap<int64_t, Setdigest_t> Sets{};
+        Hashmap<uint32_t, bool> Shared{};
+
+        Query("SELECT Timestamp / ? AS Bucket, Messagetype, COUNT(*), Digest(Signature) FROM Rawsyncpacket WHERE Timestamp >= ? AND Timestamp < ? GROUP BY Bucket, Messagetype;",
+              Bucketwidth, First * Bucketwidth, Last * Bucketwidth)
+            >> [&](int64_t Bucket, uint32_t Messagetype, uint32_t Count, int64_t Digest)
+        {
+            if (isShared(Shared, Messagetype)) Sets[Bucket].merge({ Count, uint64_t(Digest) });
+        };
+
+        Hashmap<int64_t, Bucketdigest_t> Result{};
+        for (const auto &[Bucket, Set] : Sets) Result[Bucket] = { Bucket, Set.Count, Set.Digest };
+        return Result;
+    }
+    static std::vector<uint64_t> LocalIDs(int64_t Bucket)
+    {
+        std::vector<uint64_t> Result{};
+        Hashmap<uint32_t, bool> Shared{};
+
+        Query("SELECT Signature, Messagetype FROM Rawsyncpacket WHERE Timestamp >= ? AND Timestamp < ?;", Bucket * Bucketwidth, (Bucket + 1) * Bucketwidth)
+            >> [&](const Blob_t &Signature, uint32_t Messagetype) { if (isShared(Shared, Messagetype)) Result.emplace_back(Hash::WW64(Signature)); };
+
+        std::ranges::sort(Result);
+        return Result;
+    }
+
+    // Broadcast our view of the recent buckets.
+    static void __cdecl Senddigest()
+    {
+        const auto Last = Currentbucket();
+        const auto Digests = Localdigests(Last - Reconcilewindow, Last);
+        if (Digests.empty()) return;
+
+        std::vector<Bucketdigest_t> Payload{};
+        Payload.reserve(Digests.size());
+        for (const auto &[Bucket, Digest] : Digests) Payload.emplace_back(Digest);
+
+        const auto Packet = Synchronization::Createmessage("Reconcile::Digest", Bytebuffer_t(Payload.data(), Payload.size() * sizeof(Bucketdigest_t)));
+        Network::PublishLAN(Packet);
+        Digestbytes += Packet.size();
+
+        // Forget buckets outside of the window.
+        for (auto It = Bucketstats.begin(); It != Bucketstats.end();)
+        {
+            if (It->first < (Last - Reconcilewindow)) Bucketstats.erase(It++);
+            else ++It;
+        }
+    }
+
+    // Send our IDs for a bucket, in sorted chunks.
+    static void Sendinventory(int64_t Bucket)
+    {
+        auto &Stats = Bucketstats[Bucket];
+
+        // Several peers may report the same bucket, once per period is enough.
+        if ((GetTickCount() - Stats.Lastinventory) < Reconcileperiod) return;
+        Stats.Lastinventory = GetTickCount();
+
+        const auto IDs = LocalIDs(Bucket);
+        for (const auto &Chunk : Setdigest_t::Chunk(IDs, Inventorysize))
+        {
+            const Inventoryheader_t Header{ Bucket, Chunk.Low, Chunk.High };
+
+            Blob_t Payload(reinterpret_cast<const uint8_t *>(&Header), sizeof(Header));
+            Payload.append(reinterpret_cast<const uint8_t *>(Chunk.IDs.data()), Chunk.IDs.size() * sizeof(uint64_t));
+
+            const auto Packet = Synchronization::Createmessage("Reconcile::Inventory", Payload);
+            Network::PublishLAN(Packet);
+
+            Stats.Bytessent += Packet.size();
+        }
+    }
+
+    // Re-broadcast the packets in a bucket that the peer did not list.
+    static void Retransmit(const qDSA::Publickey_t &Requester, int64_t Bucket, const Setdigest_t::Chunk_t &Remote)
+    {
+        const auto Now = GetTickCount();
+
+        // Forget the previous period.
+        if (Requesters.size() >= Maxrequesters && !Requesters.contains(Requester)) [[unlikely]] Requesters.erase(Requesters.begin());
+        auto &Share = Requesters[Requester];
+        if (Now - Share.Windowstart >= Reconcileperiod) Share = { Now, 0, 0 };
+
+        // Every inventory is a full scan of the bucket.
+        if (++Share.Inventories > Maxinventories || Share.Packets >= Retransmitlimit)
+        {
+            ++Throttled;
+            return;
+        }
+
+        for (auto It = Recentlysent.begin(); It != Recentlysent.end();)
+        {
+            if (Now - It->second >= Reconcileperiod) Recentlysent.erase(It++);
+            else ++It;
+        }
+
+        auto &Stats = Bucketstats[Bucket];
+        Hashmap<uint32_t, bool> Shared{};
+
+        Query("SELECT Publickey, Signature, Messagetype, Timestamp, Envelope, Data FROM Rawsyncpacket WHERE Timestamp >= ? AND Timestamp < ?;",
+              Bucket * Bucketwidth, (Bucket + 1) * Bucketwidth)
+            >> [&](const Blob_t &Publickey, const Blob_t &Signature, uint32_t Messagetype, int64_t Timestamp, int64_t Envelope, const Blob_t &Data) -> bool
+        {
+            const auto ID = Hash::WW64(Signature);
+            if (!Setdigest_t::Lacks(Remote, ID)) return true;
+
+            // Not in the peer's inventory either way, or it would drop it before verification.
+            if (!isShared(Shared, Messagetype) || !Network::Interests::isInterested(Requester, Messagetype)) return true;
+
+            if (Publickey.size() != sizeof(qDSA::Publickey_t) || Signature.size() != sizeof(qDSA::Signature_t)) [[unlikely]]
+                return true;
+
+            // Someone else asked for it already.
+            if (Recentlysent.contains(ID)) return true;
+            if (Recentlysent.size() >= Maxrecentlysent) [[unlikely]] return false;
+            Recentlysent[ID] = Now;
+
+            // Rebuild the original datagram.
+            Blob_t Packet(sizeof(Network::Header_t) + Data.size(), 0);
+            const auto Header = reinterpret_cast<Network::Header_t *>(Packet.data());
+            std::memcpy(Header->Signature.data(), Signature.data(), Signature.size());
+            std::memcpy(Header->Publickey.data(), Publickey.data(), Publickey.size());
+            Header->Messagetype = Messagetype;
+            Header->Timestamp = Timestamp | Envelope;
+            std::memcpy(Packet.data() + sizeof(Network::Header_t), Data.data(), Data.size());
+
+            Network::PublishLAN(Packet);
+            Stats.Bytessent += Packet.size();
+            ++Retransmitted;
+
+            // Let the next round handle the rest.
+            return ++Share.Packets < Retransmitlimit;
+        };
+    }
+
+    // A peer broadcast its digests.
+    static void __cdecl onDigest(const qDSA::Publickey_t &, int64_t, int64_t, const Bytebuffer_t &Payload)
+    {
+        if (Payload.size() % sizeof(Bucketdigest_t)) [[unlikely]] return;
+        const auto Remote = std::span(reinterpret_cast<const Bucketdigest_t *>(Payload.data()), Payload.size() / sizeof(Bucketdigest_t));
+        Digestbytes += Payload.size() + sizeof(Network::Header_t);
+
+        const auto Last = Currentbucket();
+        const auto Local = Localdigests(Last - Reconcilewindow, Last);
+
+        for (const auto &Item : Remote)
+        {
+            // Different windows or clocks, ignore.
+            if (Item.Bucket < (Last - Reconcilewindow) || Item.Bucket >= Last) continue;
+
+            auto &Stats = Bucketstats[Item.Bucket];
+            const auto Entry = Local.find(Item.Bucket);
+            const auto isEqual = Entry != Local.end() && Entry->second.Count == Item.Count && Entry->second.Digest == Item.Digest;
+
+            if (isEqual)
+            {
+                // Converged since the last mismatch.
+                if (Stats.Mismatchsince)
+                {
+                    Stats.Convergencetime = GetTickCount() - Stats.Mismatchsince;
+                    Stats.Mismatchsince = 0;
+                }
+                continue;
+            }
+
+            if (!Stats.Mismatchsince) Stats.Mismatchsince = GetTickCount();
+            Sendinventory(Item.Bucket);
+        }
+    }
+
+    // A peer listed what it has in a bucket.
+    static void __cdecl onInventory(const qDSA::Publickey_t &Publickey, int64_t, int64_t, const Bytebuffer_t &Payload)
+    {
+        if (Payload.size() < sizeof(Inventoryheader_t) || (Payload.size() - sizeof(Inventoryheader_t)) % sizeof(uint64_t)) [[unlikely]] return;
+
+        const auto Header = reinterpret_cast<const Inventoryheader_t *>(Payload.data());
+        const auto IDs = std::span(reinterpret_cast<const uint64_t *>(Payload.data() + sizeof(Inventoryheader_t)),
+                                   (Payload.size() - sizeof(Inventoryheader_t)) / sizeof(uint64_t));
+
+        const auto Last = Currentbucket();
+        if (Header->Bucket < (Last - Reconcilewindow) || Header->Bucket >= Last) return;
+        if (!std::ranges::is_sorted(IDs)) [[unlikely]] return;
+
+        Bucketstats[Header->Bucket].Bytesreceived += Payload.size() + sizeof(Network::Header_t);
+        Retransmit(Publickey, Header->Bucket, { Header->Low, Header->High, IDs });
+    }
+
+    // On startup.
+    static void __cdecl Initialize()
+    {
+        const auto &Settings = Config::getSettings();
+        Reconcileperiod = std::max(Settings.value<uint32_t>("Reconcileperiod", Reconcileperiod), 1000U);
+        Reconcilewindow = std::max(Settings.value<uint32_t>("Reconcilewindow", Reconcilewindow), 1U);
+
+        // Control messages are not worth storing.
+        Synchronization::Register("Reconcile::Digest", Synchronization::Retention_t{ .Ephemeral = true });
+        Synchronization::Register("Reconcile::Inventory", Synchronization::Retention_t{ .Ephemeral = true });
+        Synchronization::Register("Reconcile::Digest", onDigest);
+        Synchronization::Register("Reconcile::Inventory", onInventory);
+
+        // Clients in other games don't have the same packets, so only compare with our own.
+        Network::Route("Reconcile::Digest", Network::Channel_t::Game);
+        Network::Route("Reconcile::Inventory", Network::Channel_t::Game);
+
+        Enqueuetask(Senddigest, Reconcileperiod);
+
+        // Let the user check how well the network converges.
+        static constexpr auto Printstats = [](int, const char **)
+        {
+            std::vector<std::pair<int64_t, Bucketstats_t>> Sorted(Bucketstats.begin(), Bucketstats.end());
+            std::ranges::sort(Sorted, {}, &std::pair<int64_t, Bucketstats_t>::first);
+
+            Infoprint(va("Reconciliation: %llu digest bytes, %llu packets retransmitted, %llu inventories throttled", Digestbytes, Retransmitted, Throttled));
+            for (const auto &[Bucket, Stats] : Sorted)
+            {
+                const auto State = Stats.Mismatchsince ? va("diverged for %u ms", GetTickCount() - Stats.Mismatchsince) : va("converged in %u ms", Stats.Convergencetime);
+                Infoprint(va("Bucket %lld: %s, %llu bytes sent, %llu bytes received", Bucket, State.c_str(), Stats.Bytessent, Stats.Bytesreceived));
+            }
+        };
+        Communication::Console::addCommand(u8"Reconcilestats", Printstats);
+    }
+
+    // Register initialization to run on startup.
+    struct Startup_t { Startup_t() { Backgroundtasks::addStartuptask(Initialize); } } Startup{};
+}
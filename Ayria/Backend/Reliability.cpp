@@ -0,0 +1,342 @@
+/*
+    Initial author: Convery (tcn@ayria.se)
+    Started: 2023-04-01
+    License: MIT
+
+    NACK-based recovery for the multicast group.
+    Publishers prefix the signed payload with a sequence number, receivers track the gaps per publisher and
+    ask for them after a short delay, the publisher then retransmits from its history or the DB.
+    Receivers that overhear a NACK for the same packets hold back their own.
+    Only types on the base channel are sequenced, as every client joins it; the others are left to reconciliation.
+*/
+
+#include <Ayria.hpp>
+
+namespace Backend::Network::Reliability
+{
+    // Our latest packets, indexed by sequence.
+    struct Sent_t
+    {
+        uint32_t Sequence{}, Lastsent{};
+        Blob_t Packet{};
+    };
+    constexpr size_t Historysize = 1024;
+    static std::array<Sent_t, Historysize> History{};
+    static Spinlock_t Historylock{};
+
+    // Older packets are loaded from the DB, throttled the same way; shares the history lock.
+    static Hashmap<uint32_t, uint32_t> Storedsent{};
+    constexpr size_t Maxstoredsent = 4096;
+
+    // Gaps older than the window are left to reconciliation.
+    struct Missing_t
+    {
+        uint32_t Detected, Lastnack;
+        uint8_t Attempts;
+    };
+    struct Stream_t
+    {
+        uint32_t Highest{};
+        std::map<uint32_t, Missing_t> Missing{};
+    };
+    static Hashmap<qDSA::Publickey_t, Stream_t, decltype(WW64::Hash)> Streams{};
+    static Spinlock_t Streamlock{};
+
+    constexpr size_t Maxmissing = 256, Maxstreams = 1024, Maxranges = 32, Maxretransmits = 64;
+    constexpr uint8_t Maxattempts = 5;
+
+    // Configurable via Config.json, the delay allows for some reordering.
+    static uint32_t Nackdelay{ 10 }, Nackinterval{ 40 };
+
+    // For tuning the recovery.
+    static std::atomic<uint64_t> Gaps{}, Recovered{}, Abandoned{}, Nackssent{}, Retransmitted{}, Unavailable{};
+
+    // Inclusive range of sequence numbers.
+    #pragma pack(push, 1)
+    struct Range_t { uint32_t First, Last; };
+    #pragma pack(pop)
+
+    // Continues from the highest sequence in the DB rather than the newest, as the clock may have moved back.
+    // Zero means unsequenced.
+    uint32_t Nextsequence()
+    {
+        static std::atomic<uint32_t> Sequence{};
+        static std::once_flag Seeded{};
+
+        std::call_once(Seeded, []()
+        {
+            Query("SELECT MAX(substr(Data, 1, 4)) FROM Rawsyncpacket WHERE Publickey = ? AND (Envelope & ?) != 0;",
+                  Blob_view_t(Global.Publickey.data(), Global.Publickey.size()), int64_t(Sequenced))
+                >> [](const Blob_t &Highest) { Sequence.store(Synchronization::getSequence(Envelopemarker | Sequenced, Highest)); };
+        });
+
+        auto Result = Sequence.fetch_add(1) + 1;
+        while (!Result) [[unlikely]] Result = Sequence.fetch_add(1) + 1;
+        return Result;
+    }
+
+    // Our own packets are kept for a while to answer NACKs.
+    void Remember(uint32_t Sequence, const Blob_t &Packet)
+    {
+        std::scoped_lock Guard(Historylock);
+        History[Sequence % Historysize] = { Sequence, 0, Packet };
+    }
+
+    // Unverified sequences may be forged, so they never start or reset a stream.
+    static void Advance(const qDSA::Publickey_t &Publickey, uint32_t Sequence, bool isVerified)
+    {
+        if (!Sequence) return;
+
+        const auto Now = GetTickCount();
+        std::scoped_lock Guard(Streamlock);
+
+        if (!isVerified && !Streams.contains(Publickey)) return;
+        if (Streams.size() >= Maxstreams && !Streams.contains(Publickey)) [[unlikely]] Streams.clear();
+        auto &Stream = Streams[Publickey];
+
+        // Joined late, or the publisher lost its DB.
+        if (!Stream.Highest || Sequence + 0x10000 < Stream.Highest) [[unlikely]]
+        {
+            if (!isVerified) return;
+
+            Stream.Highest = Sequence;
+            Stream.Missing.clear();
+            return;
+        }
+
+        // Retransmitted or reordered.
+        if (Sequence <= Stream.Highest)
+        {
+            if (Stream.Missing.erase(Sequence)) Recovered.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        // Only the newest part of a large gap is worth asking for.
+        const auto First = std::max(Stream.Highest + 1, Sequence > Maxmissing ? Sequence - uint32_t(Maxmissing) : 1U);
+        Abandoned.fetch_add(First - (Stream.Highest + 1), std::memory_order_relaxed);
+        Gaps.fetch_add(Sequence - First, std::memory_order_relaxed);
+
+        for (auto i = First; i < Sequence; ++i)
+            Stream.Missing.emplace(i, Missing_t{ Now, 0, 0 });
+        Stream.Highest = Sequence;
+
+        while (Stream.Missing.size() > Maxmissing)
+        {
+            Stream.Missing.erase(Stream.Missing.begin());
+            Abandoned.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    // Verified packets from other publishers.
+    void Track(const qDSA::Publickey_t &Publickey, uint32_t Sequence)
+    {
+        Advance(Publickey, Sequence, true);
+    }
+
+    // Filtered packets are dropped before verification, but still take their place in the stream.
+    void Skip(const qDSA::Publickey_t &Publickey, uint32_t Sequence)
+    {
+        Advance(Publickey, Sequence, false);
+    }
+
+    // Only stored packets can be served once they leave the history.
+    static Blob_t Loadpacket(uint32_t Sequence)
+    {
+        static auto Select = Database::Open() << "SELECT Signature, Messagetype, Timestamp, Envelope, Data FROM Rawsyncpacket WHERE Publickey = ? "
+                                                 "AND Timestamp >= ? AND (Envelope & ?) != 0 AND substr(Data, 1, 4) = ? LIMIT 1;";
+        const auto Cutoff = getTimestamp() - std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::minutes(10)).count();
+        Blob_t Packet{};
+
+        Select << Blob_view_t(Global.Publickey.data(), Global.Publickey.size()) << Cutoff << int64_t(Sequenced);
+        const auto Bigsequence = cmp::toBig(Sequence);
+        Select << Blob_view_t(reinterpret_cast<const uint8_t *>(&Bigsequence), sizeof(Bigsequence));
+        Select >> [&](const Blob_t &Signature, uint32_t Messagetype, int64_t Timestamp, int64_t Envelope, const Blob_t &Data)
+        {
+            if (Signature.size() != sizeof(qDSA::Signature_t)) [[unlikely]] return;
+
+            // Rebuild the original datagram.
+            Packet.resize(sizeof(Header_t) + Data.size());
+            const auto Header = reinterpret_cast<Header_t *>(Packet.data());
+            std::memcpy(Header->Signature.data(), Signature.data(), Signature.size());
+            Header->Publickey = Global.Publickey;
+            Header->Messagetype = Messagetype;
+            Header->Timestamp = Timestamp | Envelope;
+            std::memcpy(Packet.data() + sizeof(Header_t), Data.data(), Data.size());
+        };
+
+        return Packet;
+    }
+
+    // Several receivers usually miss the same packet, so only answer once per interval.
+    static void Retransmit(std::span<const Range_t> Ranges)
+    {
+        const auto Now = GetTickCount();
+        std::vector<uint32_t> Stored{};
+        std::vector<Blob_t> Packets{};
+
+        {
+            std::scoped_lock Guard(Historylock);
+
+            for (const auto &Range : Ranges)
+            {
+                for (auto Sequence = Range.First; Sequence <= Range.Last && Sequence >= Range.First; ++Sequence)
+                {
+                    if (Packets.size() + Stored.size() >= Maxretransmits) break;
+
+                    auto &Entry = History[Sequence % Historysize];
+                    if (Entry.Sequence != Sequence)
+                    {
+                        // Forget the ones that can be sent again, if that's not enough the rest waits for the next NACK.
+                        if (Storedsent.size() >= Maxstoredsent && !Storedsent.contains(Sequence)) [[unlikely]]
+                        {
+                            for (auto It = Storedsent.begin(); It != Storedsent.end();)
+                            {
+                                if (Now - It->second >= Nackinterval) Storedsent.erase(It++);
+                                else ++It;
+                            }
+                            if (Storedsent.size() >= Maxstoredsent) break;
+                        }
+
+                        auto &Lastsent = Storedsent[Sequence];
+                        if (Now - Lastsent < Nackinterval) continue;
+                        Lastsent = Now;
+
+                        Stored.emplace_back(Sequence);
+                        continue;
+                    }
+
+                    if (Now - Entry.Lastsent < Nackinterval) continue;
+                    Entry.Lastsent = Now;
+                    Packets.emplace_back(Entry.Packet);
+                }
+            }
+        }
+
+        for (const auto Sequence : Stored)
+        {
+            auto Packet = Loadpacket(Sequence);
+            if (Packet.empty()) Unavailable.fetch_add(1, std::memory_order_relaxed);
+            else Packets.emplace_back(std::move(Packet));
+        }
+
+        for (const auto &Packet : Packets)
+            PublishLAN(Packet);
+
+        Retransmitted.fetch_add(Packets.size(), std::memory_order_relaxed);
+    }
+
+    // Someone is missing packets.
+    static void __cdecl onNACK(const qDSA::Publickey_t &, int64_t, int64_t, const Bytebuffer_t &Payload)
+    {
+        if (Payload.size() < sizeof(qDSA::Publickey_t) + sizeof(Range_t)) [[unlikely]] return;
+        if ((Payload.size() - sizeof(qDSA::Publickey_t)) % sizeof(Range_t)) [[unlikely]] return;
+
+        qDSA::Publickey_t Target{};
+        std::memcpy(Target.data(), Payload.data(), Target.size());
+        const auto Ranges = std::span(reinterpret_cast<const Range_t *>(Payload.data() + Target.size()),
+                                      (Payload.size() - Target.size()) / sizeof(Range_t));
+
+        if (Target == Global.Publickey) return Retransmit(Ranges);
+
+        // The retransmission reaches us as well, so hold back our own NACK.
+        const auto Now = GetTickCount();
+        std::scoped_lock Guard(Streamlock);
+
+        const auto Stream = Streams.find(Target);
+        if (Stream == Streams.end()) return;
+
+        for (const auto &Range : Ranges)
+        {
+            for (auto It = Stream->second.Missing.lower_bound(Range.First); It != Stream->second.Missing.end() && It->first <= Range.Last; ++It)
+                It->second.Lastnack = Now;
+        }
+    }
+
+    // Every 10ms, the interval doubles with every attempt.
+    static void __cdecl Sendnacks()
+    {
+        const auto Now = GetTickCount();
+        std::vector<Blob_t> Requests{};
+
+        {
+            std::scoped_lock Guard(Streamlock);
+
+            for (auto &[Publickey, Stream] : Streams)
+            {
+                if (Stream.Missing.empty()) [[likely]] continue;
+
+                Blob_t Request(Publickey.data(), Publickey.size());
+                std::optional<Range_t> Current{};
+                size_t Count{};
+
+                const auto Flush = [&]()
+                {
+                    if (!Current) return;
+                    Request.append(reinterpret_cast<const uint8_t *>(&*Current), sizeof(Range_t));
+                    Current.reset();
+                    ++Count;
+                };
+
+                for (auto It = Stream.Missing.begin(); It != Stream.Missing.end() && Count < Maxranges;)
+                {
+                    auto &Missing = It->second;
+
+                    if (Missing.Attempts >= Maxattempts)
+                    {
+                        Abandoned.fetch_add(1, std::memory_order_relaxed);
+                        Stream.Missing.erase(It++);
+                        continue;
+                    }
+
+                    const auto isDue = (Now - Missing.Detected) >= Nackdelay && (Now - Missing.Lastnack) >= (Nackinterval << Missing.Attempts);
+                    if (isDue)
+                    {
+                        if (Current && Current->Last + 1 == It->first) Current->Last = It->first;
+                        else { Flush(); Current = Range_t{ It->first, It->first }; }
+
+                        Missing.Lastnack = Now;
+                        ++Missing.Attempts;
+                    }
+
+                    ++It;
+                }
+
+                Flush();
+                if (Count) Requests.emplace_back(std::move(Request));
+            }
+        }
+
+        for (const auto &Request : Requests)
+            PublishLAN(Synchronization::Createmessage("Network::NACK", Request));
+
+        Nackssent.fetch_add(Requests.size(), std::memory_order_relaxed);
+    }
+
+    // On startup.
+    static void __cdecl Initialize()
+    {
+        const auto &Settings = Config::getSettings();
+        Nackdelay = Settings.value<uint32_t>("NACKDelay", Nackdelay);
+        Nackinterval = std::max(Settings.value<uint32_t>("NACKInterval", Nackinterval), 10U);
+
+        Synchronization::Register("Network::NACK", Synchronization::Retention_t{ .Ephemeral = true });
+        Synchronization::Register("Network::NACK", onNACK);
+        Enqueuetask(Sendnacks, 10);
+
+        static constexpr auto Printstats = [](int, const char **)
+        {
+            size_t Pending{};
+            {
+                std::scoped_lock Guard(Streamlock);
+                for (const auto &[Publickey, Stream] : Streams) Pending += Stream.Missing.size();
+            }
+
+            Infoprint(va("Reliability: %llu gaps, %llu recovered, %llu abandoned, %zu pending, %llu NACKs sent, %llu retransmitted, %llu unavailable",
+                         Gaps.load(), Recovered.load(), Abandoned.load(), Pending, Nackssent.load(), Retransmitted.load(), Unavailable.load()));
+        };
+        Communication::Console::addCommand(u8"NACKstats", Printstats);
+    }
+
+    // Register initialization to run on startup.
+    struct Startup_t { Startup_t() { Backgroundtasks::addStartuptask(Initialize); } } Startup{};
+}
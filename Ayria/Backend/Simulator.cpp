@@ -0,0 +1,361 @@
+/*
+    Initial author: Convery (tcn@ayria.se)
+    Started: 2023-03-28
+    License: MIT
+
+    In-process network of virtual nodes for tuning synchronization without extra machines.
+    Each node has its own key and in-memory database, packets travel through a shared medium with
+    loss, latency, reordering and bandwidth limits. The local client joins as a normal transport.
+
+    NOTE(tcn): This only models the medium. Virtual nodes store into their own Packets table and repair
+    by swapping ID lists, they don't run verification, Rawsyncpacket, NACKs or the bucketed reconciliation.
+    So the numbers show how loss and latency affect convergence, not how the real pipeline performs;
+    only the local client runs that, and it's the one to watch in the other *stats commands.
+*/
+
+#include <Ayria.hpp>
+
+namespace Backend::Network::Simulator
+{
+    using Clock_t = std::chrono::steady_clock;
+    constexpr uint32_t Localnode = UINT32_MAX;
+    constexpr uint32_t Benchmarktype = Hash::WW32("Simulator::Message");
+    constexpr size_t Repairlimit = 256;
+
+    // Set from the console.
+    struct Settings_t
+    {
+        uint32_t Nodes{ 8 }, Messages{ 100 }, Rate{ 50 }, Payloadsize{ 256 };  // Rate is per node and second.
+        uint32_t Latency{ 5 }, Jitter{ 2 }, Bandwidth{};                       // Milliseconds, KiB/s per node with 0 as unlimited.
+        float Loss{ 1.0f }, Reorder{ 1.0f };                                    // Percent.
+        uint32_t Repairperiod{ 100 }, Timeout{ 30000 };                        // Milliseconds.
+    };
+
+    struct Node_t
+    {
+        qDSA::Publickey_t Publickey;
+        qDSA::Privatekey_t Privatekey;
+        std::shared_ptr<sqlite3> Connection;
+
+        Clock_t::time_point Linkfree, Converged;
+        uint64_t Bytessent, Bytesreceived, Packetsreceived;
+        uint32_t Published, Stored;
+    };
+
+    // Ordered by time, the earliest first.
+    enum class Eventtype_t : uint8_t { Publish, Deliver, Repair, Summary };
+    struct Event_t
+    {
+        Clock_t::time_point Time;
+        Eventtype_t Type;
+        uint32_t Source, Target;
+        Sharedbuffer_t Packet;
+
+        bool operator>(const Event_t &Right) const { return Time > Right.Time; }
+    };
+
+    static std::priority_queue<Event_t, std::vector<Event_t>, std::greater<>> Events{};
+    static std::condition_variable Eventsignal{};
+    static std::mutex Eventlock{};
+
+    static std::vector<Node_t> Nodes{};
+    static std::atomic<bool> isRunning{};
+    static Settings_t Settings{};
+    static uint64_t Lost{};
+
+    static bool Chance(float Percent)
+    {
+        return float(RNG::Next() % 100000) < Percent * 1000.0f;
+    }
+
+    // Needs to hold the lock, returns when the last byte has left the node.
+    static Clock_t::time_point Uplink(uint32_t Source, size_t Size, Clock_t::time_point Now)
+    {
+        if (Source == Localnode) return Now;
+
+        auto &Node = Nodes[Source];
+        Node.Bytessent += Size;
+        if (!Settings.Bandwidth) return Now;
+
+        Node.Linkfree = std::max(Node.Linkfree, Now) + std::chrono::microseconds(Size * 1000000 / (Settings.Bandwidth * 1024ULL));
+        return Node.Linkfree;
+    }
+
+    // Needs to hold the lock.
+    static void Schedule(Eventtype_t Type, uint32_t Source, uint32_t Target, const Sharedbuffer_t &Packet, Clock_t::time_point Departure)
+    {
+        if (Chance(Settings.Loss))
+        {
+            ++Lost;
+            return;
+        }
+
+        // Jitter alone rarely reorders, so some packets take a much longer path.
+        auto Delay = Settings.Latency + (Settings.Jitter ? uint32_t(RNG::Next() % (Settings.Jitter + 1)) : 0);
+        if (Chance(Settings.Reorder)) Delay += Settings.Latency * 4 + 1;
+
+        Events.emplace(Departure + std::chrono::milliseconds(Delay), Type, Source, Target, Packet);
+    }
+    static void Broadcast(uint32_t Source, const Sharedbuffer_t &Packet, Clock_t::time_point Now)
+    {
+        const auto Departure = Uplink(Source, Packet.size(), Now);
+
+        for (uint32_t i = 0; i < Nodes.size(); ++i)
+        {
+            if (i != Source) Schedule(Eventtype_t::Deliver, Source, i, Packet, Departure);
+        }
+        if (Source != Localnode) Schedule(Eventtype_t::Deliver, Source, Localnode, Packet, Departure);
+    }
+    static void Unicast(Eventtype_t Type, uint32_t Source, uint32_t Target, const Sharedbuffer_t &Packet, Clock_t::time_point Now)
+    {
+        Schedule(Type, Source, Target, Packet, Uplink(Source, Packet.size(), Now));
+    }
+
+    // Same header as Createmessage, but with the nodes key; no envelope or sequence as the nodes don't use them.
+    static Sharedbuffer_t Createmessage(const Node_t &Node, uint32_t Messagetype, std::span<const uint8_t> Payload)
+    {
+        auto Packet = Sharedbuffer_t::Allocate(sizeof(Header_t) + Payload.size());
+        const auto Header = reinterpret_cast<Header_t *>(Packet.data());
+
+        Header->Timestamp = getTimestamp() & ~Envelopemask;
+        Header->Publickey = Node.Publickey;
+        Header->Messagetype = Messagetype;
+
+        std::memcpy(Packet.data() + sizeof(Header_t), Payload.data(), Payload.size());
+        Header->Signature = qDSA::Sign(Node.Publickey, Node.Privatekey, std::span(Packet.data() + 96, Payload.size() + 12));
+        return Packet;
+    }
+
+    // Returns false for duplicates.
+    static bool Store(const Node_t &Node, const Sharedbuffer_t &Packet)
+    {
+        const auto Header = reinterpret_cast<const Header_t *>(Packet.data());
+        int Inserted{};
+
+        sqlite::Database_t{ Node.Connection.get() } << "INSERT OR IGNORE INTO Packets VALUES (?, ?, ?) RETURNING 1;"
+            << int64_t(Hash::WW64(Header->Signature)) << Header->Messagetype << Blob_view_t(Packet.data(), Packet.size()) >> Inserted;
+
+        return Inserted;
+    }
+
+    // Returns true when the node has converged.
+    static bool Deliver(Node_t &Node, const Sharedbuffer_t &Packet, Clock_t::time_point Now)
+    {
+        Node.Bytesreceived += Packet.size();
+        Node.Packetsreceived++;
+
+        if (Packet.size() < sizeof(Header_t)) [[unlikely]] return false;
+        if (!Store(Node, Packet)) return false;
+
+        const auto Header = reinterpret_cast<const Header_t *>(Packet.data());
+        if (Header->Messagetype != Benchmarktype) return false;
+
+        if (++Node.Stored != Settings.Nodes * Settings.Messages) return false;
+        Node.Converged = Now;
+        return true;
+    }
+
+    // Sorted IDs, so the peer can reply with what we are missing.
+    static Sharedbuffer_t Createsummary(const Node_t &Node)
+    {
+        std::vector<int64_t> IDs{};
+        sqlite::Database_t{ Node.Connection.get() } << "SELECT ID FROM Packets ORDER BY ID;" >> [&](int64_t ID) { IDs.emplace_back(ID); };
+
+        return Sharedbuffer_t::Copy(std::span(reinterpret_cast<const uint8_t *>(IDs.data()), IDs.size() * sizeof(int64_t)));
+    }
+    static std::vector<Sharedbuffer_t> Findmissing(const Node_t &Node, const Sharedbuffer_t &Summary)
+    {
+        const auto Remote = std::span(reinterpret_cast<const int64_t *>(Summary.data()), Summary.size() / sizeof(int64_t));
+        std::vector<Sharedbuffer_t> Result{};
+
+        sqlite::Database_t{ Node.Connection.get() } << "SELECT ID, Packet FROM Packets;" >> [&](int64_t ID, const Blob_t &Packet) -> bool
+        {
+            if (!std::ranges::binary_search(Remote, ID)) Result.emplace_back(Sharedbuffer_t::Copy(Packet));
+            return Result.size() < Repairlimit;
+        };
+
+        return Result;
+    }
+
+    // The local client publishing through the transport.
+    static void __cdecl Publishlocal(const Blob_t &Packet)
+    {
+        if (!isRunning.load(std::memory_order_acquire)) [[likely]] return;
+
+        std::scoped_lock Guard(Eventlock);
+        if (!isRunning.load(std::memory_order_relaxed)) return;
+
+        Broadcast(Localnode, Sharedbuffer_t::Copy(Packet), Clock_t::now());
+        Eventsignal.notify_one();
+    }
+
+    // Runs the events in real-time so that the local client can take part.
+    static void Simulationthread()
+    {
+        // Name this thread for easier debugging.
+        setThreadname("Ayria_Simulator");
+
+        const auto Start = Clock_t::now();
+        const auto Deadline = Start + std::chrono::milliseconds(Settings.Timeout);
+        const auto Payload = Blob_t(Settings.Payloadsize, 0xAA);
+        uint32_t Remaining = Settings.Nodes;
+
+        while (Remaining)
+        {
+            Event_t Event{};
+
+            {
+                std::unique_lock Guard(Eventlock);
+
+                const auto Now = Clock_t::now();
+                if (Now >= Deadline) break;
+
+                // New events may arrive while waiting.
+                if (Events.empty() || Events.top().Time > Now)
+                {
+                    Eventsignal.wait_until(Guard, Events.empty() ? Deadline : std::min(Events.top().Time, Deadline));
+                    continue;
+                }
+
+                Event = std::move(const_cast<Event_t &>(Events.top()));
+                Events.pop();
+            }
+
+            const auto Now = Clock_t::now();
+            switch (Event.Type)
+            {
+                case Eventtype_t::Publish:
+                {
+                    auto &Node = Nodes[Event.Source];
+                    const auto Packet = Createmessage(Node, Benchmarktype, Payload);
+                    if (Deliver(Node, Packet, Now)) --Remaining;
+
+                    std::scoped_lock Guard(Eventlock);
+                    Broadcast(Event.Source, Packet, Now);
+
+                    if (++Node.Published < Settings.Messages)
+                        Events.emplace(Now + std::chrono::microseconds(1000000 / Settings.Rate), Eventtype_t::Publish, Event.Source, Event.Source, Sharedbuffer_t{});
+                    break;
+                }
+
+                case Eventtype_t::Deliver:
+                {
+                    if (Event.Target == Localnode) Receive(std::move(Event.Packet));
+                    else if (Deliver(Nodes[Event.Target], Event.Packet, Now)) --Remaining;
+                    break;
+                }
+
+                case Eventtype_t::Repair:
+                {
+                    const auto Summary = Createsummary(Nodes[Event.Source]);
+                    const auto Peer = uint32_t((Event.Source + 1 + RNG::Next() % (Nodes.size() - 1)) % Nodes.size());
+
+                    std::scoped_lock Guard(Eventlock);
+                    Unicast(Eventtype_t::Summary, Event.Source, Peer, Summary, Now);
+                    Events.emplace(Now + std::chrono::milliseconds(Settings.Repairperiod), Eventtype_t::Repair, Event.Source, Event.Source, Sharedbuffer_t{});
+                    break;
+                }
+
+                case Eventtype_t::Summary:
+                {
+                    Nodes[Event.Target].Bytesreceived += Event.Packet.size();
+                    const auto Missing = Findmissing(Nodes[Event.Target], Event.Packet);
+
+                    std::scoped_lock Guard(Eventlock);
+                    for (const auto &Packet : Missing) Unicast(Eventtype_t::Deliver, Event.Target, Event.Source, Packet, Now);
+                    break;
+                }
+            }
+        }
+
+        // Stop accepting packets from the local client before cleaning up.
+        std::scoped_lock Guard(Eventlock);
+        isRunning.store(false, std::memory_order_release);
+        Events = {};
+
+        uint64_t Sent{}, Received{}, Packets{};
+        int64_t Slowest{};
+        for (const auto &Node : Nodes)
+        {
+            Sent += Node.Bytessent;
+            Received += Node.Bytesreceived;
+            Packets += Node.Packetsreceived;
+
+            const auto Finished = Node.Stored == Settings.Nodes * Settings.Messages ? Node.Converged : Clock_t::now();
+            Slowest = std::max(Slowest, int64_t(std::chrono::duration_cast<std::chrono::milliseconds>(Finished - Start).count()));
+        }
+
+        const auto Elapsed = std::max(int64_t(1), int64_t(std::chrono::duration_cast<std::chrono::milliseconds>(Clock_t::now() - Start).count()));
+        Infoprint(va("Simulator: %u of %u nodes converged after %lld ms", Settings.Nodes - Remaining, Settings.Nodes, Slowest));
+        Infoprint(va("Simulator: %.0f messages/s delivered, %llu lost in transit", double(Packets) * 1000.0 / double(Elapsed), Lost));
+        Infoprint(va("Simulator: %llu bytes sent and %llu bytes received per node", Sent / Nodes.size(), Received / Nodes.size()));
+
+        Nodes.clear();
+    }
+
+    // Simulate [Nodes] [Messages] [Loss %] [Latency ms] [Jitter ms] [Bandwidth KiB/s] [Reorder %]
+    static void __cdecl Simulate(int Argc, const char **Argv)
+    {
+        if (isRunning.load(std::memory_order_acquire))
+        {
+            Infoprint("Simulator: a run is already in progress.");
+            return;
+        }
+
+        // The previous run may still be cleaning up.
+        std::scoped_lock Guard(Eventlock);
+        Settings = {};
+        if (Argc > 0) Settings.Nodes = std::clamp(uint32_t(std::strtoul(Argv[0], nullptr, 10)), 2U, 256U);
+        if (Argc > 1) Settings.Messages = std::max(uint32_t(std::strtoul(Argv[1], nullptr, 10)), 1U);
+        if (Argc > 2) Settings.Loss = std::clamp(std::strtof(Argv[2], nullptr), 0.0f, 99.0f);
+        if (Argc > 3) Settings.Latency = uint32_t(std::strtoul(Argv[3], nullptr, 10));
+        if (Argc > 4) Settings.Jitter = uint32_t(std::strtoul(Argv[4], nullptr, 10));
+        if (Argc > 5) Settings.Bandwidth = uint32_t(std::strtoul(Argv[5], nullptr, 10));
+        if (Argc > 6) Settings.Reorder = std::clamp(std::strtof(Argv[6], nullptr), 0.0f, 100.0f);
+
+        Nodes.clear();
+        Nodes.resize(Settings.Nodes);
+        Lost = 0;
+
+        for (auto &Node : Nodes)
+        {
+            const std::array<uint64_t, 4> Seed{ RNG::Next(), RNG::Next(), RNG::Next(), RNG::Next() };
+            std::tie(Node.Publickey, Node.Privatekey) = qDSA::Createkeypair(Hash::SHA512(Seed));
+
+            sqlite3 *Ptr{};
+            (void)sqlite3_open_v2(":memory:", &Ptr, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, nullptr);
+            Node.Connection = std::shared_ptr<sqlite3>(Ptr, sqlite3_close_v2);
+
+            sqlite::Database_t{ Ptr } << "CREATE TABLE Packets (ID INTEGER PRIMARY KEY, Messagetype INTEGER NOT NULL, Packet BLOB NOT NULL);";
+        }
+
+        // Spread the nodes out a little so that they don't all publish at once.
+        const auto Now = Clock_t::now();
+        for (uint32_t i = 0; i < Settings.Nodes; ++i)
+        {
+            const auto Offset = std::chrono::microseconds(RNG::Next() % (1000000 / Settings.Rate));
+            Events.emplace(Now + Offset, Eventtype_t::Publish, i, i, Sharedbuffer_t{});
+            Events.emplace(Now + Offset + std::chrono::milliseconds(Settings.Repairperiod), Eventtype_t::Repair, i, i, Sharedbuffer_t{});
+        }
+
+        Infoprint(va("Simulator: %u nodes, %u messages each, %.1f%% loss, %u+%u ms latency, %u KiB/s, %.1f%% reordered",
+                     Settings.Nodes, Settings.Messages, Settings.Loss, Settings.Latency, Settings.Jitter, Settings.Bandwidth, Settings.Reorder));
+        Infoprint("Simulator: virtual nodes only model the medium, only the local client runs the real sync path.");
+
+        isRunning.store(true, std::memory_order_release);
+        std::thread(Simulationthread).detach();
+    }
+
+    // On startup.
+    static void __cdecl Initialize()
+    {
+        // Benchmark traffic should not end up in the users database.
+        Synchronization::Register("Simulator::Message", Synchronization::Retention_t{ .Ephemeral = true });
+
+        Register(Scope_t::LAN, Publishlocal);
+        Communication::Console::addCommand(u8"Simulate", Simulate);
+    }
+
+    // Register initialization to run on startup.
+    struct Startup_t { Startup_t() { Backgroundtasks::addStartuptask(Initialize); } } Startup{};
+}
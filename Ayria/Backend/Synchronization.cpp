@@ -9,105 +9,589 @@
 namespace Backend::Synchronization
 {
     static Hashmap<uint32_t, Hashset<Callback_t>> Messagehandlers{};
-    static Hashset<int64_t> Modifiedrows{};
+
+    // Types with a handler or policy, read from the receiving threads.
+    static Hashset<uint32_t> Interests{};
+    static Spinlock_t Interestlock{};
+
+    // Verified packets waiting for the next transaction.
+    struct Pendingpacket_t
+    {
+        qDSA::Signature_t Signature;
+        qDSA::Publickey_t Publickey;
+        uint32_t Messagetype;
+        int64_t Timestamp;
+        Sharedbuffer_t Payload;
+    };
+    static MPSCQueue_t<Pendingpacket_t, 8192> Pendingpackets{};
+    static Spinlock_t Consumerlock{};
+    static std::atomic<uint32_t> Pendingsince{};
+
+    // Inserted packets waiting for their handlers, no need to go through the DB again.
+    struct Dispatchpacket_t
+    {
+        qDSA::Publickey_t Publickey;
+        uint32_t Messagetype;
+        int64_t Timestamp;
+        int64_t RowID;
+        Sharedbuffer_t Payload;
+    };
+    static std::vector<Dispatchpacket_t> Dispatchqueue{};
+
+    // Trade commit-rate for delivery delay, configurable via Config.json.
+    // The flush runs on the background thread, which ticks every 50ms; so that is also the lowest latency.
+    constexpr uint32_t Flushgranularity = 50;
+    static uint32_t Batchlatency{ 50 }, Batchsize{ 256 };
+
+    // Pruning resumes from the last row seen, a full pass is repeated every minute.
+    // Nextpass is only compared once a pass has finished, as a fresh cursor would look far in the future after ~25 days of uptime.
+    struct Prunecursor_t
+    {
+        int64_t Timestamp{ INT64_MIN }, RowID{};
+        uint32_t Nextpass{};
+        bool isWaiting{};
+    };
+    static Hashmap<uint32_t, Retention_t> Retentionpolicies{};
+    static Hashmap<uint32_t, Prunecursor_t> Prunecursors{};
+    static Prunecursor_t Defaultcursor{};
+
+    // Publishers that may exceed their count limit after an insert.
+    #pragma pack(push, 1)
+    struct Overcount_t
+    {
+        qDSA::Publickey_t Publickey;
+        uint32_t Messagetype;
+
+        bool operator==(const Overcount_t &) const = default;
+    };
+    #pragma pack(pop)
+    static Hashset<Overcount_t, decltype(WW64::Hash)> Overcount{};
+
+    // Keys that may have older packets after an insert.
+    #pragma pack(push, 1)
+    struct Compactable_t
+    {
+        qDSA::Publickey_t Publickey;
+        uint32_t Messagetype;
+        int64_t Subject;
+
+        bool operator==(const Compactable_t &) const = default;
+    };
+    #pragma pack(pop)
+    static Hashset<Compactable_t, decltype(WW64::Hash)> Compactable{};
+
+    // Max milliseconds per tick spent pruning, configurable via Config.json.
+    static uint32_t Prunebudget{ 5 };
+
+    // Payloads smaller than this are sent as-is, configurable via Config.json.
+    static uint32_t Compressionthreshold{ 256 };
+    constexpr uint32_t Maxdecompressed = 16 * 1024 * 1024;
+
+    // LZ4 block with the original size as prefix.
+    static Blob_t Compress(std::span<const uint8_t> Payload)
+    {
+        #if defined (HAS_LZ4)
+        const auto Bound = LZ4_compressBound(int(Payload.size()));
+        Blob_t Result(sizeof(uint32_t) + Bound, 0);
+
+        const auto Originalsize = uint32_t(Payload.size());
+        std::memcpy(Result.data(), &Originalsize, sizeof(Originalsize));
+
+        const auto Size = LZ4_compress_default((const char *)Payload.data(), (char *)Result.data() + sizeof(uint32_t), int(Payload.size()), Bound);
+        if (Size <= 0) return {};
+
+        Result.resize(sizeof(uint32_t) + Size);
+        return Result;
+        #else
+        (void)Payload;
+        return {};
+        #endif
+    }
+    Blob_t Decompress(std::span<const uint8_t> Payload)
+    {
+        #if defined (HAS_LZ4)
+        if (Payload.size() <= sizeof(uint32_t)) [[unlikely]] return {};
+
+        uint32_t Originalsize{};
+        std::memcpy(&Originalsize, Payload.data(), sizeof(Originalsize));
+        if (!Originalsize || Originalsize > Maxdecompressed) [[unlikely]] return {};
+
+        Blob_t Result(Originalsize, 0);
+        const auto Size = LZ4_decompress_safe((const char *)Payload.data() + sizeof(uint32_t), (char *)Result.data(), int(Payload.size() - sizeof(uint32_t)), int(Originalsize));
+        if (Size != int(Originalsize)) [[unlikely]] return {};
+
+        return Result;
+        #else
+        (void)Payload;
+        return {};
+        #endif
+    }
+
+    // The sequence number is part of the signed payload, so it's stored with the packet.
+    // Big-endian, so that the DB orders them correctly as blobs.
+    uint32_t getSequence(int64_t Timestamp, std::span<const uint8_t> Payload)
+    {
+        if (!(Network::getEnvelope(Timestamp) & Network::Sequenced) || Payload.size() < sizeof(uint32_t)) return 0;
+
+        uint32_t Sequence{};
+        std::memcpy(&Sequence, Payload.data(), sizeof(Sequence));
+        return cmp::fromBig(Sequence);
+    }
+    std::span<const uint8_t> Stripsequence(int64_t Timestamp, std::span<const uint8_t> Payload)
+    {
+        if (!(Network::getEnvelope(Timestamp) & Network::Sequenced)) return Payload;
+        return Payload.size() < sizeof(uint32_t) ? std::span<const uint8_t>{} : Payload.subspan(sizeof(uint32_t));
+    }
 
     // Create and insert messages into the database.
     Blob_t Createmessage(uint32_t Messagetype, const Bytebuffer_t &Payload)
     {
-        Blob_t Packet(sizeof(Network::Header_t) + Payload.size(), 0);
+        // Only worth it if it actually saves something.
+        Blob_t Compressed{};
+        if (Payload.size() >= Compressionthreshold)
+        {
+            Compressed = Compress(std::span(Payload.data(), Payload.size()));
+            if (Compressed.size() >= Payload.size()) Compressed.clear();
+        }
+
+        const auto isCompressed = !Compressed.empty();
+        const auto Body = isCompressed ? std::span<const uint8_t>(Compressed) : std::span(Payload.data(), Payload.size());
+
+        // Receivers only see the channels they joined, so a shared counter would show gaps on all of them.
+        const auto isSequenced = Network::getChannel(Messagetype) == Network::Channel_t::Base;
+        const auto Sequence = isSequenced ? Network::Reliability::Nextsequence() : 0;
+        const auto Prefix = isSequenced ? sizeof(Sequence) : 0;
+
+        Blob_t Packet(sizeof(Network::Header_t) + Prefix + Body.size(), 0);
         const auto Header = reinterpret_cast<Network::Header_t *>(Packet.data());
-        const auto Signedpart = std::span(Packet.data() + 96, Payload.size() + 12);
+        const auto Signedpart = std::span(Packet.data() + 96, Prefix + Body.size() + 12);
 
         // Timetamp in UTC
-        Header->Timestamp = std::chrono::high_resolution_clock::now().time_since_epoch().count();
+        Header->Timestamp = Network::getTimestamp() & ~Network::Envelopemask;
         Header->Publickey = Global.Publickey;
         Header->Messagetype = Messagetype;
+        Header->Timestamp |= Network::Envelopemarker;
+        if (isSequenced) Header->Timestamp |= Network::Sequenced;
+        if (isCompressed) Header->Timestamp |= Network::LZ4Compressed;
 
         // Signed content.
-        std::memcpy(Packet.data() + sizeof(Network::Header_t), Payload.data(), Payload.size());
+        const auto Bigsequence = cmp::toBig(Sequence);
+        std::memcpy(Packet.data() + sizeof(Network::Header_t), &Bigsequence, Prefix);
+        std::memcpy(Packet.data() + sizeof(Network::Header_t) + Prefix, Body.data(), Body.size());
         Header->Signature = qDSA::Sign(Global.Publickey, *Global.Privatekey, Signedpart);
 
-        // Assume that we are going to send this, and save it.
-        Storemessage(Header->Signature, Header->Publickey, Header->Messagetype, Header->Timestamp, Payload);
+        // Assume that we are going to send this, and save it as signed.
+        Storemessage(Header->Signature, Header->Publickey, Header->Messagetype, Header->Timestamp, Bytebuffer_t(Packet.data() + sizeof(Network::Header_t), Packet.size() - sizeof(Network::Header_t)));
+        if (isSequenced) Network::Reliability::Remember(Sequence, Packet);
 
         return Packet;
     }
     void Storemessage(const qDSA::Signature_t &Signature, const qDSA::Publickey_t &Publickey, uint32_t Messagetype, int64_t Timestamp, const Bytebuffer_t &Payload)
     {
-        const std::u8string PK = Base58::Encode(Publickey);
+        Storemessage(Signature, Publickey, Messagetype, Timestamp, Sharedbuffer_t::Copy(std::span(Payload.data(), Payload.size())));
+    }
+    void Storemessage(const qDSA::Signature_t &Signature, const qDSA::Publickey_t &Publickey, uint32_t Messagetype, int64_t Timestamp, Sharedbuffer_t &&Payload)
+    {
+        // Dropped if the DB can't keep up, tracked in the stats.
+        if (!Pendingpackets.try_emplace(Signature, Publickey, Messagetype, Timestamp, std::move(Payload))) [[unlikely]]
+            return;
+
+        // The batch-latency is measured from the oldest packet in the queue.
+        uint32_t Unset{};
+        Pendingsince.compare_exchange_strong(Unset, GetTickCount(), std::memory_order_relaxed);
+    }
+
+    // Commit queued packets, one transaction per batch.
+    static size_t Commitpackets()
+    {
+        const auto Database = Database::Open();
 
-        // Ensure that an account exists for this PK.
-        const auto ShortID = (Hash::WW64(Publickey) << 32) | Hash::WW32(Publickey);
-        Query("INSERT OR IGNORE INTO Account VALUES (?, ?, ?, ?);", PK, Timestamp, Timestamp, ShortID).Execute();
+        // Prepared once and reused for every batch.
+        static auto Insertaccount = Database << "INSERT INTO Account VALUES (?, ?, ?, ?) ON CONFLICT (Publickey) DO UPDATE SET "
+                                                "Firstseen = MIN(Firstseen, excluded.Firstseen), Lastseen = MAX(Lastseen, excluded.Lastseen);";
+        static auto Insertpacket = Database << "INSERT OR IGNORE INTO Rawsyncpacket (Publickey, Signature, Messagetype, Timestamp, Envelope, Data, Subject) "
+                                               "VALUES (?, ?, ?, ?, ?, ?, ?) RETURNING rowid;";
 
-        // Standard insert.
-        auto PS = Query("INSERT INTO Syncpacket VALUES (?, ?, ?, ?, ?) RETURNING rowid;");
-        PS << PK << (std::u8string)Base58::Encode(Signature);
-        PS << Messagetype << Timestamp;
-        PS << Base85::Encode(Payload.as_span());
+        Database << "BEGIN IMMEDIATE TRANSACTION;";
+        const auto Count = Pendingpackets.drain([&](Pendingpacket_t &&Packet)
+        {
+            Network::Capture::Trace(Network::Capture::Stage_t::Stored, Packet.Signature);
+            const std::u8string PK = Base58::Encode(Packet.Publickey);
+            const auto Envelope = Network::getEnvelope(Packet.Timestamp);
+            const auto Timestamp = Network::getTime(Packet.Timestamp);
 
-        // Returning rowid.
-        int64_t RowID;
-        PS >> RowID;
+            // Ensure that an account exists for this PK and merge the timestamps.
+            const auto ShortID = (Hash::WW64(Packet.Publickey) << 32) | Hash::WW32(Packet.Publickey);
+            Insertaccount << PK << Timestamp << Timestamp << ShortID;
+            Insertaccount.Execute();
+
+            // Gaps in the publishers sequence get NACKed, this fills them.
+            if (Packet.Publickey != Global.Publickey)
+                Network::Reliability::Track(Packet.Publickey, getSequence(Packet.Timestamp, Packet.Payload));
+
+            const auto Policy = Retentionpolicies.find(Packet.Messagetype);
+            const auto hasPolicy = Policy != Retentionpolicies.end();
+
+            // Control messages skip the DB entirely.
+            if (hasPolicy && Policy->second.Ephemeral) [[unlikely]]
+            {
+                if (Packet.Publickey != Global.Publickey && Messagehandlers.contains(Packet.Messagetype))
+                    Dispatchqueue.emplace_back(Packet.Publickey, Packet.Messagetype, Packet.Timestamp, 0, std::move(Packet.Payload));
+                return;
+            }
+
+            // Only compacted types get a subject.
+            std::optional<int64_t> Subject{};
+
+            if (hasPolicy && Policy->second.Compact)
+            {
+                const auto Body = Stripsequence(Packet.Timestamp, Packet.Payload);
+
+                if (!Policy->second.Subject) Subject = 0;
+                else if (Envelope & Network::LZ4Compressed) Subject = int64_t(Policy->second.Subject(Bytebuffer_t(Decompress(Body))));
+                else Subject = int64_t(Policy->second.Subject(Bytebuffer_t(Body.data(), Body.size())));
+            }
+
+            // Duplicates are ignored and return no row.
+            Insertpacket << Blob_view_t(Packet.Publickey.data(), Packet.Publickey.size());
+            Insertpacket << Blob_view_t(Packet.Signature.data(), Packet.Signature.size());
+            Insertpacket << Packet.Messagetype << Timestamp << Envelope << Blob_view_t(Packet.Payload.data(), Packet.Payload.size()) << Subject;
+
+            // Returning rowid.
+            int64_t RowID{};
+            Insertpacket >> RowID;
+
+            // Check the limits on the next prune.
+            if (RowID && hasPolicy)
+            {
+                if (Policy->second.Maxperpublisher) Overcount.insert({ Packet.Publickey, Packet.Messagetype });
+                if (Subject) Compactable.insert({ Packet.Publickey, Packet.Messagetype, *Subject });
+            }
+
+            // Hand off for processing next frame (if not ours).
+            if (RowID && Packet.Publickey != Global.Publickey && Messagehandlers.contains(Packet.Messagetype))
+                Dispatchqueue.emplace_back(Packet.Publickey, Packet.Messagetype, Packet.Timestamp, RowID, std::move(Packet.Payload));
+        }, Batchsize);
+        Database << "COMMIT TRANSACTION;";
 
-        // Mark for processing next frame (if not ours).
-        if (Publickey != Global.Publickey) Modifiedrows.insert(RowID);
+        return Count;
+    }
+    static void Flushpackets(bool Force)
+    {
+        static uint64_t Lastrejected{};
+
+        // The final flush at exit may race the background thread.
+        std::scoped_lock Guard(Consumerlock);
+
+        if (Pendingpackets.empty()) [[likely]]
+            return;
+
+        // Only unset if a producer got between the queue and the stamp.
+        uint32_t Unset{};
+        Pendingsince.compare_exchange_strong(Unset, GetTickCount(), std::memory_order_relaxed);
+
+        // Wait until either limit is reached.
+        const auto Elapsed = GetTickCount() - Pendingsince.load(std::memory_order_relaxed);
+        if (!Force && Elapsed < Batchlatency && Pendingpackets.size() < Batchsize)
+            return;
 
-        // Update timestamps.
-        int64_t First{}, Last{};
-        Query("SELECT Firstseen, Lastseen FROM Account WHERE Publickey = ?;", PK) >> std::tie(First, Last);
-        Query("UPDATE Account SET Firstseen = ?, Lastseen = ? WHERE Publickey = ?;", std::min(First, Timestamp), std::max(Last, Timestamp), PK).Execute();
+        // Cleared first, so that packets queued while committing stamp it again.
+        Pendingsince.store(0, std::memory_order_relaxed);
+
+        // Keep the transactions reasonably sized.
+        while (!Pendingpackets.empty() && Commitpackets() == Batchsize) {}
+
+        // Let the developer know that the queue needs to be larger.
+        if (const auto Stats = Pendingpackets.getStatistics(); Stats.Rejected != Lastrejected) [[unlikely]]
+        {
+            Debugprint(va("Synchronization: dropped %llu packets, highwater %zu", Stats.Rejected - Lastrejected, Stats.Highwater));
+            Lastrejected = Stats.Rejected;
+        }
+    }
+    static void __cdecl Flushtask()
+    {
+        Flushpackets(false);
     }
 
     // Parse a message and insert into the client row.
     void Register(uint32_t Messagetype, Callback_t Callback)
     {
         Messagehandlers[Messagetype].insert(Callback);
+
+        std::scoped_lock Guard(Interestlock);
+        Interests.insert(Messagetype);
+    }
+    void Register(uint32_t Messagetype, const Retention_t &Policy)
+    {
+        Retentionpolicies[Messagetype] = Policy;
+
+        std::scoped_lock Guard(Interestlock);
+        Interests.insert(Messagetype);
+    }
+
+    // Anything else is only stored for other clients.
+    bool isInteresting(uint32_t Messagetype)
+    {
+        std::scoped_lock Guard(Interestlock);
+        return Interests.contains(Messagetype);
+    }
+    std::vector<uint32_t> getInteresting()
+    {
+        std::scoped_lock Guard(Interestlock);
+        return { Interests.begin(), Interests.end() };
     }
 
     // Check for new inserts every 50ms.
     static void __cdecl Poll()
     {
-        Hashset<int64_t> Rows{};
-        Modifiedrows.swap(Rows);
+        std::vector<Dispatchpacket_t> Packets{};
+        Dispatchqueue.swap(Packets);
 
-        for (const auto Row : Rows)
+        for (auto &Packet : Packets)
         {
-            Query("SELECT * FROM Syncpacket WHERE rowid = ?;", Row) >> [&](const std::u8string &Publickey, const std::u8string &, uint32_t Messagetype, int64_t Timestamp, const Blob_t &Data)
+            // Only decompressed once, right before the handlers need it.
+            const auto Body = Stripsequence(Packet.Timestamp, Packet.Payload);
+            Blob_t Decompressed{};
+            if (Network::getEnvelope(Packet.Timestamp) & Network::LZ4Compressed)
             {
-                if (Messagehandlers.contains(Messagetype))
-                {
-                    // Known input size.
-                    std::array<char8_t, Base58::Encodesize(sizeof(qDSA::Publickey_t))> Fixedsize{};
-                    std::ranges::copy(Publickey, Fixedsize.data());
+                Decompressed = Decompress(Body);
+                if (Decompressed.empty()) [[unlikely]] continue;
+            }
 
-                    const auto Payload = Bytebuffer_t(Base85::Decode(Data));
-                    const auto PK = Base58::Decode(Fixedsize);
+            const auto Timestamp = Network::getTime(Packet.Timestamp);
+            const auto Payload = Decompressed.empty() ? Bytebuffer_t(Body.data(), Body.size()) : Bytebuffer_t(Decompressed.data(), Decompressed.size());
+            for (const auto Handler : Messagehandlers[Packet.Messagetype])
+            {
+                Handler(Packet.Publickey, Packet.RowID, Timestamp, Payload);
+            }
+        }
+    }
 
-                    for (const auto Handler : Messagehandlers[Messagetype])
-                    {
-                        Handler(PK, Row, Timestamp, Data);
-                    }
-                }
-            };
+    // Keyset pagination over the (Messagetype, Timestamp) index, rowid breaks ties.
+    Replaycursor_t::Replaycursor_t(uint32_t Messagetype, int64_t Since) : Messagetype(Messagetype), Timestamp(Since)
+    {
+        Query("SELECT IFNULL(MAX(rowid), 0) FROM Rawsyncpacket;") >> Lastrow;
+    }
+    bool Replaycursor_t::Next(Callback_t Callback, uint32_t Batchsize)
+    {
+        static auto Select = Database::Open() << "SELECT rowid, Publickey, Timestamp, Envelope, Data FROM Rawsyncpacket WHERE Messagetype = ? "
+                                                 "AND (Timestamp, rowid) > (?, ?) AND rowid <= ? ORDER BY Timestamp, rowid LIMIT ?;";
+        struct Row_t { qDSA::Publickey_t Publickey; int64_t RowID, Timestamp; Blob_t Payload; };
+
+        // Handlers may query the DB, so don't call them while stepping.
+        thread_local std::vector<Row_t> Batch{};
+        Batch.clear();
+
+        Select << Messagetype << Timestamp << RowID << Lastrow << Batchsize;
+        Select >> [&](int64_t Row, const Blob_t &Publickey, int64_t Time, int64_t Envelope, Blob_t &&Payload)
+        {
+            Timestamp = Time;
+            RowID = Row;
+
+            if (Envelope & Network::Sequenced) Payload.erase(0, std::min(Payload.size(), sizeof(uint32_t)));
+            if (Envelope & Network::LZ4Compressed) Payload = Decompress(Payload);
+            if (Publickey.size() != sizeof(qDSA::Publickey_t) || ((Envelope & Network::LZ4Compressed) && Payload.empty())) [[unlikely]] return;
+            auto &Entry = Batch.emplace_back(qDSA::Publickey_t{}, Row, Time, std::move(Payload));
+            std::memcpy(Entry.Publickey.data(), Publickey.data(), Entry.Publickey.size());
+        };
+
+        for (const auto &Entry : Batch)
+        {
+            Callback(Entry.Publickey, Entry.RowID, Entry.Timestamp, Bytebuffer_t(Entry.Payload));
+        }
+
+        return Batch.size() == Batchsize;
+    }
+
+    // Active background replays.
+    static std::vector<std::pair<Replaycursor_t, Callback_t>> Replays{};
+    void Replay(uint32_t Messagetype, int64_t Since, Callback_t Callback)
+    {
+        Replays.emplace_back(Replaycursor_t(Messagetype, Since), Callback);
+    }
+    static void __cdecl Replaytask()
+    {
+        if (Replays.empty()) [[likely]] return;
+
+        // Handlers may start new replays.
+        decltype(Replays) Current{};
+        Current.swap(Replays);
+
+        std::erase_if(Current, [](auto &Item) { return !Item.first.Next(Item.second); });
+        Replays.insert(Replays.begin(), Current.begin(), Current.end());
+    }
+
+    // Rows referenced by services fail the foreign-key check, so errors are expected and ignored.
+    static void Deleterows(std::span<const int64_t> Rows)
+    {
+        if (Rows.empty()) return;
+        const auto Database = Database::Open();
+
+        // The wrapper asserts on errors, so use the raw interface.
+        static const auto Delete = [&]()
+        {
+            sqlite3_stmt *Statement{};
+            sqlite3_prepare_v3(Database.Connection, "DELETE FROM Rawsyncpacket WHERE rowid = ?;", -1, SQLITE_PREPARE_PERSISTENT, &Statement, nullptr);
+            return std::shared_ptr<sqlite3_stmt>(Statement, sqlite3_finalize);
+        }();
+
+        Database << "BEGIN IMMEDIATE TRANSACTION;";
+        for (const auto RowID : Rows)
+        {
+            sqlite3_bind_int64(Delete.get(), 1, RowID);
+            (void)sqlite3_step(Delete.get());
+            sqlite3_reset(Delete.get());
         }
+        Database << "COMMIT TRANSACTION;";
     }
 
-    // Prune the DB on exit.
-    static void CleanupDB()
+    // Delete a batch of expired rows, returns false when the pass is done.
+    static bool Prunebyage(uint32_t Messagetype, int64_t Cutoff, Prunecursor_t &Cursor)
     {
-        // Only remove packets if the user wants to.
-        if (!!Global.Configuration.pruneDB)
+        static auto Select = Database::Open() << "SELECT rowid, Timestamp FROM Rawsyncpacket WHERE Messagetype = ? AND Timestamp < ? "
+                                                 "AND (Timestamp, rowid) > (?, ?) ORDER BY Timestamp, rowid LIMIT 128;";
+        std::vector<int64_t> Rows{};
+        Rows.reserve(128);
+
+        Select << Messagetype << Cutoff << Cursor.Timestamp << Cursor.RowID;
+        Select >> [&](int64_t RowID, int64_t Timestamp)
+        {
+            Rows.emplace_back(RowID);
+            Cursor.Timestamp = Timestamp;
+            Cursor.RowID = RowID;
+        };
+
+        Deleterows(Rows);
+        return Rows.size() == 128;
+    }
+    static bool Prunedefault(int64_t Cutoff, Prunecursor_t &Cursor)
+    {
+        static auto Select = Database::Open() << "SELECT rowid, Timestamp, Messagetype FROM Rawsyncpacket WHERE Timestamp < ? "
+                                                 "AND (Timestamp, rowid) > (?, ?) ORDER BY Timestamp, rowid LIMIT 128;";
+        std::vector<int64_t> Rows{};
+        size_t Count{};
+        Rows.reserve(128);
+
+        Select << Cutoff << Cursor.Timestamp << Cursor.RowID;
+        Select >> [&](int64_t RowID, int64_t Timestamp, uint32_t Messagetype)
         {
-            // Assume all services save a foreign-key reference to rowid's they want preserved..
-            const auto Timestamp = (std::chrono::system_clock::now() - std::chrono::hours(24)).time_since_epoch();
+            // Types with a policy are handled separately.
+            if (!Retentionpolicies.contains(Messagetype)) Rows.emplace_back(RowID);
+            Cursor.Timestamp = Timestamp;
+            Cursor.RowID = RowID;
+            ++Count;
+        };
+
+        Deleterows(Rows);
+        return Count == 128;
+    }
+    static void Prunebycount(const qDSA::Publickey_t &Publickey, uint32_t Messagetype, uint32_t Limit)
+    {
+        static auto Select = Database::Open() << "SELECT rowid FROM Rawsyncpacket WHERE Publickey = ? AND Messagetype = ? "
+                                                 "ORDER BY Timestamp DESC LIMIT 128 OFFSET ?;";
+        std::vector<int64_t> Rows{};
+        Rows.reserve(128);
+
+        Select << Blob_view_t(Publickey.data(), Publickey.size()) << Messagetype << Limit;
+        Select >> [&](int64_t RowID) { Rows.emplace_back(RowID); };
+        Deleterows(Rows);
 
-            // TODO(tcn): Find a way to "DELETE FROM Syncpacket WHERE (Timestamp < ?)" while ignoring errors.
-            std::vector<int64_t> Rows{};
-            Query("SELECT rowid FROM Syncpacket WHERE (Timestamp < ?);", Timestamp.count()) >> Rows;
-            for (const auto &Row : Rows)
+        // Continue next tick.
+        if (Rows.size() == 128) Overcount.insert({ Publickey, Messagetype });
+    }
+
+    static void Compact(const qDSA::Publickey_t &Publickey, uint32_t Messagetype, int64_t Subject)
+    {
+        static auto Select = Database::Open() << "SELECT rowid FROM Rawsyncpacket WHERE Publickey = ? AND Messagetype = ? AND Subject = ? "
+                                                 "ORDER BY Timestamp DESC LIMIT 128 OFFSET 1;";
+        std::vector<int64_t> Rows{};
+        Rows.reserve(128);
+
+        Select << Blob_view_t(Publickey.data(), Publickey.size()) << Messagetype << Subject;
+        Select >> [&](int64_t RowID) { Rows.emplace_back(RowID); };
+        Deleterows(Rows);
+
+        // Continue next tick.
+        if (Rows.size() == 128) Compactable.insert({ Publickey, Messagetype, Subject });
+    }
+
+    // Incremental pruning, limited to a few ms per tick.
+    static void __cdecl Prunetask()
+    {
+        const auto Deadline = GetTickCount() + Prunebudget;
+        const auto Now = Network::getTimestamp();
+        const auto Passdelay = 60 * 1000;
+
+        // Databases from before the policy was registered may not have been marked.
+        static bool Initialcount{};
+        if (!Initialcount) [[unlikely]]
+        {
+            Initialcount = true;
+            for (const auto &[Messagetype, Policy] : Retentionpolicies)
             {
-                Query("DELETE FROM Syncpacket WHERE (rowid = ?);", Row).Execute();
+                if (!Policy.Maxperpublisher) continue;
+
+                Query("SELECT Publickey FROM Rawsyncpacket WHERE Messagetype = ? GROUP BY Publickey HAVING COUNT(*) > ?;", Messagetype, Policy.Maxperpublisher)
+                    >> [&, Messagetype](const Blob_t &Publickey)
+                {
+                    if (Publickey.size() != sizeof(qDSA::Publickey_t)) return;
+
+                    qDSA::Publickey_t Key;
+                    std::memcpy(Key.data(), Publickey.data(), Key.size());
+                    Overcount.insert({ Key, Messagetype });
+                };
+            }
+        }
+
+        // Count limits are driven by the ingest.
+        while (!Overcount.empty() && int32_t(Deadline - GetTickCount()) > 0)
+        {
+            const auto [Publickey, Messagetype] = *Overcount.begin();
+            Overcount.erase(Overcount.begin());
+
+            if (const auto Policy = Retentionpolicies.find(Messagetype); Policy != Retentionpolicies.end() && Policy->second.Maxperpublisher)
+                Prunebycount(Publickey, Messagetype, Policy->second.Maxperpublisher);
+        }
+
+        // Superseded packets, usually a single row per key.
+        while (!Compactable.empty() && int32_t(Deadline - GetTickCount()) > 0)
+        {
+            const auto [Publickey, Messagetype, Subject] = *Compactable.begin();
+            Compactable.erase(Compactable.begin());
+
+            Compact(Publickey, Messagetype, Subject);
+        }
+
+        // Age limits by type.
+        for (const auto &[Messagetype, Policy] : Retentionpolicies)
+        {
+            if (!Policy.Maxage.count()) continue;
+
+            auto &Cursor = Prunecursors[Messagetype];
+            if (Cursor.isWaiting && int32_t(GetTickCount() - Cursor.Nextpass) < 0) continue;
+
+            const auto Cutoff = Now - std::chrono::duration_cast<std::chrono::nanoseconds>(Policy.Maxage).count();
+            while (int32_t(Deadline - GetTickCount()) > 0)
+            {
+                if (!Prunebyage(Messagetype, Cutoff, Cursor))
+                {
+                    Cursor = { INT64_MIN, 0, GetTickCount() + Passdelay, true };
+                    break;
+                }
+            }
+        }
+
+        // Everything else, if the user wants to.
+        if (!!Global.Configuration.pruneDB && (!Defaultcursor.isWaiting || int32_t(GetTickCount() - Defaultcursor.Nextpass) >= 0))
+        {
+            const auto Cutoff = Now - std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::hours(24)).count();
+            while (int32_t(Deadline - GetTickCount()) > 0)
+            {
+                if (!Prunedefault(Cutoff, Defaultcursor))
+                {
+                    Defaultcursor = { INT64_MIN, 0, GetTickCount() + Passdelay, true };
+                    break;
+                }
             }
         }
     }
@@ -115,31 +599,25 @@ namespace Backend::Synchronization
     // On startup.
     static void __cdecl Initialize()
     {
-        constexpr auto Syncpacket =
-            "CREATE TABLE IF NOT EXISTS Syncpacket ("
-            "Publickey TEXT REFERENCES Account(Publickey) ON DELETE CASCADE, "
-            "Signature TEXT, "
-
-            "Messagetype INTEGER, "
-            "Timestamp INTEGER, "
-
-            "Data BLOB,"
-            "UNIQUE (Publickey, Signature) );";
-
-        // Set up DB table.
-        Query(Syncpacket).Execute();
+        // Optional tuning of the ingest.
+        const auto &Settings = Config::getSettings();
+        Batchlatency = std::max(Settings.value<uint32_t>("Batchlatency", Batchlatency), Flushgranularity);
+        Batchsize = std::max(Settings.value<uint32_t>("Batchsize", Batchsize), 1U);
+        Prunebudget = std::max(Settings.value<uint32_t>("Prunebudget", Prunebudget), 1U);
+        Compressionthreshold = Settings.value<uint32_t>("Compressionthreshold", Compressionthreshold);
 
         // Announce ourselves (and ensure that we exist in the DB).
         Network::Publish(Createmessage("Clientstartup", {}), true);
 
-        // Add periodic tasks.
+        // Add periodic tasks, checking the batch on every tick.
+        Enqueuetask(Flushtask, 1);
         Enqueuetask(Poll, 50);
+        Enqueuetask(Prunetask, 100);
+        Enqueuetask(Replaytask, 1);
 
-        // Ensure all messages are processed.
+        // Ensure all messages are processed (atexit is LIFO).
         (void)std::atexit(Poll);
-
-        // Remove old syncpackets.
-        (void)std::atexit(CleanupDB);
+        (void)std::atexit([]() { Flushpackets(true); });
     }
 
     // Register initialization to run on startup.
@@ -0,0 +1,275 @@
+/*
+    Initial author: Convery (tcn@ayria.se)
+    Started: 2023-03-14
+    License: MIT
+*/
+
+#include <Ayria.hpp>
+
+namespace Backend::Verification
+{
+    // Signature + Publickey, the first 96 bytes of the header.
+    using Packetkey_t = std::array<uint8_t, 96>;
+    using Filter_t = Seenfilter_t<Packetkey_t, 8192>;
+
+    // Refilled on use, time in milliseconds.
+    struct Tokenbucket_t
+    {
+        float Tokens;
+        uint32_t Lastrefill;
+
+        bool Refill(float Rate, float Burst, uint32_t Now)
+        {
+            Tokens = std::min(Burst, Tokens + float(Now - Lastrefill) * Rate / 1000.0f);
+            Lastrefill = Now;
+            return Tokens >= 1.0f;
+        }
+        bool Take(float Rate, float Burst, uint32_t Now)
+        {
+            if (!Refill(Rate, Burst, Now)) return false;
+            Tokens -= 1.0f;
+            return true;
+        }
+
+        // May go negative when more was admitted than verified, paid back by the refills.
+        void Charge() { Tokens -= 1.0f; }
+    };
+
+    // Packets are sharded by publisher, so each publisher is verified in order.
+    // Duplicates from the same publisher also end up in the same shard's filter.
+    struct Worker_t
+    {
+        std::atomic<uint32_t> Queuedcount{};
+        std::deque<Sharedbuffer_t> Queue{};
+        Spinlock_t Threadsafe{};
+
+        // Checked on enqueue and by the worker.
+        Filter_t Filter{};
+        Spinlock_t Filterlock{};
+
+        // Only for the publishers in this shard, guarded by Threadsafe.
+        Hashmap<qDSA::Publickey_t, Tokenbucket_t, decltype(WW64::Hash)> Buckets{};
+    };
+    static std::vector<std::unique_ptr<Worker_t>> Workers{};
+    static std::atomic<bool> isRunning{};
+
+    // Configurable via Config.json.
+    static Droppolicy_t Droppolicy{ Droppolicy_t::Dropnewest };
+    static size_t Queuelimit{ 1024 };
+
+    // Packets per second, zero disables the limit; configurable via Config.json.
+    static uint32_t Publisherrate{ 200 }, Publisherburst{ 400 }, Floodrate{ 5000 };
+    constexpr size_t Maxbuckets = 4096;
+
+    // Shared by all publishers, new keys are free so this is what stops a flood.
+    static Tokenbucket_t Floodbucket{};
+    static Spinlock_t Floodlock{};
+
+    // For tuning the pool.
+    static std::atomic<uint64_t> Verified{}, Rejected{}, Dropped{}, Duplicates{};
+    static std::atomic<uint64_t> Ratelimited{}, Floodlimited{};
+
+    // Validate the integrity of the packet and forward it to the DB.
+    static bool isDuplicate(Worker_t *Worker, const Packetkey_t &Key)
+    {
+        std::scoped_lock Guard(Worker->Filterlock);
+        if (!Worker->Filter.contains(Key)) return false;
+
+        Duplicates.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    static void Verifypacket(const Sharedbuffer_t &Packet, Worker_t *Worker)
+    {
+        const auto Header = reinterpret_cast<const Network::Header_t *>(Packet.data());
+        const auto Signedpart = std::span(Packet.data() + 96, Packet.size() - 96);
+
+        // Copies that were queued before the first one was verified.
+        Packetkey_t Key;
+        std::memcpy(Key.data(), Packet.data(), Key.size());
+        if (Worker && isDuplicate(Worker, Key)) return;
+
+        if (!qDSA::Verify(Header->Publickey, Header->Signature, Signedpart)) [[unlikely]]
+        {
+            Rejected.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        if (Worker)
+        {
+            // Only remember valid packets, so forgeries can't shadow real ones.
+            {
+                std::scoped_lock Guard(Worker->Filterlock);
+                Worker->Filter.insert(Key);
+            }
+
+            // Only verified packets are charged, so forgeries can't use up a publishers budget.
+            if (Publisherrate)
+            {
+                std::scoped_lock Guard(Worker->Threadsafe);
+                const auto Bucket = Worker->Buckets.find(Header->Publickey);
+                if (Bucket != Worker->Buckets.end()) Bucket->second.Charge();
+            }
+        }
+
+        Verified.fetch_add(1, std::memory_order_relaxed);
+        Network::Capture::Trace(Network::Capture::Stage_t::Verified, Header->Signature);
+        Synchronization::Storemessage(Header->Signature, Header->Publickey, Header->Messagetype, Header->Timestamp, Packet.subspan(sizeof(Network::Header_t)));
+    }
+
+    // Low-priority threads, one per shard.
+    static void Workerthread(Worker_t *Worker)
+    {
+        // Name this thread for easier debugging.
+        setThreadname("Ayria_Verificationthread");
+
+        std::deque<Sharedbuffer_t> Packets{};
+        while (true)
+        {
+            // Sleep until there's work available.
+            Worker->Queuedcount.wait(0, std::memory_order_acquire);
+
+            {
+                std::scoped_lock Guard(Worker->Threadsafe);
+                Worker->Queue.swap(Packets);
+                Worker->Queuedcount.store(0, std::memory_order_release);
+            }
+
+            for (const auto &Packet : Packets) Verifypacket(Packet, Worker);
+            Packets.clear();
+        }
+    }
+
+    // Takes a reference to a raw message, packets from the same publisher are verified in order.
+    void Enqueue(Sharedbuffer_t &&Packet)
+    {
+        // Should be checked by the receiver, but better safe than sorry.
+        if (Packet.size() < sizeof(Network::Header_t)) [[unlikely]] return;
+
+        // Verify inline if the pool is not running (e.g. during startup).
+        if (!isRunning.load(std::memory_order_acquire)) [[unlikely]] return Verifypacket(Packet, nullptr);
+
+        const auto Header = reinterpret_cast<const Network::Header_t *>(Packet.data());
+        const auto &Worker = Workers[Hash::WW32(Header->Publickey) % Workers.size()];
+        const auto Now = GetTickCount();
+
+        // Re-broadcasts and retransmissions are common on LAN, they should not count against the limits.
+        Packetkey_t Key;
+        std::memcpy(Key.data(), Packet.data(), Key.size());
+        if (isDuplicate(Worker.get(), Key)) return;
+
+        {
+            std::scoped_lock Guard(Worker->Threadsafe);
+
+            // Publishers get less as the shard falls behind, but never less than a quarter.
+            if (Publisherrate)
+            {
+                const auto Load = float(Worker->Queue.size()) / float(Queuelimit);
+                const auto Rate = float(Publisherrate) * std::max(0.25f, 1.0f - Load);
+
+                // Idle publishers have full buckets, so they can be forgotten.
+                if (Worker->Buckets.size() >= Maxbuckets) [[unlikely]]
+                {
+                    for (auto It = Worker->Buckets.begin(); It != Worker->Buckets.end();)
+                    {
+                        if (uint64_t(Now - It->second.Lastrefill) * Publisherrate >= Publisherburst * 1000ULL) Worker->Buckets.erase(It++);
+                        else ++It;
+                    }
+
+                    // Mostly new keys, which would get a full bucket anyway.
+                    if (Worker->Buckets.size() >= Maxbuckets) Worker->Buckets.clear();
+                }
+
+                // The key is not verified yet, so only check the bucket here and charge it after verification.
+                if (!Worker->Buckets[Header->Publickey].Refill(Rate, float(Publisherburst), Now))
+                {
+                    Ratelimited.fetch_add(1, std::memory_order_relaxed);
+                    return;
+                }
+            }
+
+            // One second worth of burst.
+            if (Floodrate)
+            {
+                std::scoped_lock Flood(Floodlock);
+                if (!Floodbucket.Take(float(Floodrate), float(Floodrate), Now))
+                {
+                    Floodlimited.fetch_add(1, std::memory_order_relaxed);
+                    return;
+                }
+            }
+
+            // The pool has fallen behind.
+            if (Worker->Queue.size() >= Queuelimit) [[unlikely]]
+            {
+                Dropped.fetch_add(1, std::memory_order_relaxed);
+
+                if (Droppolicy == Droppolicy_t::Dropnewest) return;
+                Worker->Queue.pop_front();
+            }
+
+            Worker->Queue.emplace_back(std::move(Packet));
+            Worker->Queuedcount.store(uint32_t(Worker->Queue.size()), std::memory_order_release);
+        }
+
+        Worker->Queuedcount.notify_one();
+    }
+
+    // For tuning the pool.
+    Statistics_t getStatistics()
+    {
+        size_t Queued{};
+        uint64_t Falsepositives{};
+
+        if (isRunning.load(std::memory_order_acquire))
+        {
+            for (const auto &Worker : Workers)
+            {
+                Queued += Worker->Queuedcount.load(std::memory_order_relaxed);
+                Falsepositives += Worker->Filter.getStatistics().Falsepositives;
+            }
+        }
+
+        return { Verified.load(), Rejected.load(), Dropped.load(), Duplicates.load(), Falsepositives, Ratelimited.load(), Floodlimited.load(), Queued };
+    }
+
+    // On startup.
+    static void Initialize()
+    {
+        const auto &Settings = Config::getSettings();
+        const auto Defaultthreads = std::clamp(std::thread::hardware_concurrency() / 2, 1U, 4U);
+        const auto Threadcount = std::max(Settings.value<uint32_t>("Verificationthreads", Defaultthreads), 1U);
+
+        Queuelimit = std::max(Settings.value<uint32_t>("Verificationqueue", uint32_t(Queuelimit)), 1U);
+        if (Settings.value<std::string>("Verificationdrop") == "oldest") Droppolicy = Droppolicy_t::Dropoldest;
+
+        Publisherrate = Settings.value<uint32_t>("Publisherrate", Publisherrate);
+        Publisherburst = std::max(Settings.value<uint32_t>("Publisherburst", Publisherburst), 1U);
+        Floodrate = Settings.value<uint32_t>("Floodrate", Floodrate);
+
+        // Can't be resized later, as the threads keep a reference.
+        Workers.reserve(Threadcount);
+        for (uint32_t i = 0; i < Threadcount; ++i)
+        {
+            const auto &Worker = Workers.emplace_back(std::make_unique<Worker_t>());
+            std::thread(Workerthread, Worker.get()).detach();
+        }
+        isRunning.store(true, std::memory_order_release);
+
+        // Let the user check if the pool keeps up.
+        static constexpr auto Printstats = [](int, const char **)
+        {
+            const auto Stats = getStatistics();
+            Infoprint(va("Verification: %llu verified, %llu rejected, %llu dropped, %zu queued",
+                         Stats.Verified, Stats.Rejected, Stats.Dropped, Stats.Queued));
+            Infoprint(va("Verification: %llu duplicates skipped, %llu filter false-positives",
+                         Stats.Duplicates, Stats.Falsepositives));
+            Infoprint(va("Verification: %llu over the publisher limit, %llu over the flood limit",
+                         Stats.Ratelimited, Stats.Floodlimited));
+        };
+        Communication::Console::addCommand(u8"Verificationstats", Printstats);
+    }
+
+    // Register initialization to run on startup.
+    struct Startup_t { Startup_t() { Backgroundtasks::addStartuptask(Initialize); } } Startup{};
+}
@@ -0,0 +1,341 @@
+/*
+    Initial author: Convery (tcn@ayria.se)
+    Started: 2023-03-30
+    License: MIT
+
+    Gossip over UDP for clients outside of the multicast domain.
+    Messages are self-authenticating, so any peer can forward them as-is; each hop sends to a few
+    random peers until the TTL runs out, and duplicates are suppressed on the way.
+*/
+
+#include <Ayria.hpp>
+
+namespace Backend::Network::WANNetworking
+{
+    // Gossip frame: Magic, TTL, then the signed message.
+    constexpr uint32_t Gossipmagic = Hash::WW32("Ayria::Gossip");
+    constexpr size_t Overhead = sizeof(Gossipmagic) + sizeof(uint8_t);
+    constexpr size_t Maxpeers = 64;
+
+    // Advertisements are sent to every peer with a TTL of 1, so the sender is the publisher.
+    constexpr uint32_t Interesttype = Hash::WW32("Network::Interest");
+
+    // Configured peers are kept, learned ones are dropped when they go quiet.
+    struct Peer_t
+    {
+        sockaddr_in Address;
+        uint32_t Lastseen;
+        bool isStatic;
+    };
+    static size_t Gossipsocket{};
+    static std::vector<Peer_t> Peers{};
+    static Hashmap<uint64_t, qDSA::Publickey_t> Peerkeys{};
+    static Spinlock_t Peerlock{};
+
+    // New senders are verified inline before they are learned, so limit how often.
+    static uint32_t Learnwindow{}, Learnattempts{};
+    constexpr uint32_t Maxlearnattempts = 20;
+
+    // Keyed on the whole message, so a forged copy can't suppress the real one.
+    static Seenfilter_t<uint64_t, 8192> Seen{};
+    static Spinlock_t Seenlock{};
+
+    // Shared with verification and storage, so never freed.
+    static auto &Receivepool = *new Bufferpool_t<0x10000, 64>();
+
+    // Configurable via Config.json.
+    static uint32_t Gossipport{ 14986 }, Fanout{ 3 }, Hoplimit{ 4 }, Peertimeout{ 120000 };
+
+    // For tuning the overlay.
+    static std::atomic<uint64_t> Framessent{}, Framesreceived{}, Forwarded{}, Duplicates{}, Expired{}, Oversized{}, Senderrors{}, Uninterested{};
+    static std::atomic<uint64_t> Learned{}, Evicted{};
+
+    // IPv4 only for now, e.g. "127.0.0.1:14987".
+    static bool Parsepeer(std::string_view Address, sockaddr_in &Result)
+    {
+        const auto Colon = Address.rfind(':');
+        if (Colon == std::string_view::npos) return false;
+
+        const auto Host = std::string(Address.substr(0, Colon));
+        const auto Port = std::strtoul(std::string(Address.substr(Colon + 1)).c_str(), nullptr, 10);
+        if (!Port || Port > 0xFFFF) return false;
+
+        Result = {};
+        Result.sin_family = AF_INET;
+        Result.sin_port = cmp::toBig(uint16_t(Port));
+        return 1 == inet_pton(AF_INET, Host.c_str(), &Result.sin_addr);
+    }
+    static bool isSame(const sockaddr_in &A, const sockaddr_in &B)
+    {
+        return A.sin_port == B.sin_port && 0 == std::memcmp(&A.sin_addr, &B.sin_addr, sizeof(A.sin_addr));
+    }
+    static uint64_t Addresskey(const sockaddr_in &Address)
+    {
+        uint32_t IP{};
+        std::memcpy(&IP, &Address.sin_addr, sizeof(IP));
+        return (uint64_t(IP) << 16) | Address.sin_port;
+    }
+    static bool Addpeer(const sockaddr_in &Address, bool isStatic)
+    {
+        std::scoped_lock Guard(Peerlock);
+
+        if (std::ranges::any_of(Peers, [&](const auto &Peer) { return isSame(Peer.Address, Address); })) return true;
+        if (Peers.size() >= Maxpeers) return false;
+
+        Peers.push_back({ Address, GetTickCount(), isStatic });
+        if (!isStatic) Learned.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Returns false for unknown senders.
+    static bool Touchpeer(const sockaddr_in &Address)
+    {
+        std::scoped_lock Guard(Peerlock);
+
+        const auto Peer = std::ranges::find_if(Peers, [&](const auto &Peer) { return isSame(Peer.Address, Address); });
+        if (Peer == Peers.end()) return false;
+
+        Peer->Lastseen = GetTickCount();
+        return true;
+    }
+
+    // The source address is not authenticated, so only senders of valid messages are gossiped to.
+    static bool Learnpeer(const sockaddr_in &Address, std::span<const uint8_t> Message)
+    {
+        {
+            std::scoped_lock Guard(Peerlock);
+            if (Peers.size() >= Maxpeers) return false;
+
+            const auto Now = GetTickCount();
+            if (Now - Learnwindow >= 1000) { Learnwindow = Now; Learnattempts = 0; }
+            if (++Learnattempts > Maxlearnattempts) return false;
+        }
+
+        const auto Header = reinterpret_cast<const Header_t *>(Message.data());
+        if (!qDSA::Verify(Header->Publickey, Header->Signature, Message.subspan(96))) [[unlikely]] return false;
+
+        return Addpeer(Address, false);
+    }
+
+    // Every 10 seconds.
+    static void __cdecl Prunepeers()
+    {
+        const auto Now = GetTickCount();
+        std::scoped_lock Guard(Peerlock);
+
+        for (auto It = Peers.begin(); It != Peers.end();)
+        {
+            if (It->isStatic || Now - It->Lastseen < Peertimeout) { ++It; continue; }
+
+            Peerkeys.erase(Addresskey(It->Address));
+            Evicted.fetch_add(1, std::memory_order_relaxed);
+            It = Peers.erase(It);
+        }
+    }
+
+    // Up to Limit random peers that want the type, other than the one we got the message from.
+    static std::vector<sockaddr_in> Selectpeers(const sockaddr_in *Exclude, uint32_t Messagetype, size_t Limit)
+    {
+        std::vector<sockaddr_in> Candidates{};
+
+        {
+            std::scoped_lock Guard(Peerlock);
+            Candidates.reserve(Peers.size());
+
+            for (const auto &Peer : Peers)
+            {
+                if (Exclude && isSame(Peer.Address, *Exclude)) continue;
+
+                // They won't relay it either, the rest of the fanout covers for them.
+                if (const auto Key = Peerkeys.find(Addresskey(Peer.Address)); Key != Peerkeys.end() && !Interests::isInterested(Key->second, Messagetype))
+                {
+                    Uninterested.fetch_add(1, std::memory_order_relaxed);
+                    continue;
+                }
+
+                Candidates.emplace_back(Peer.Address);
+            }
+        }
+
+        // Partial shuffle, only the first Limit matter.
+        const auto Count = std::min(Limit, Candidates.size());
+        for (size_t i = 0; i < Count; ++i)
+            std::swap(Candidates[i], Candidates[i + RNG::Next() % (Candidates.size() - i)]);
+
+        Candidates.resize(Count);
+        return Candidates;
+    }
+
+    static void Gossip(std::span<const uint8_t> Message, uint8_t TTL, const sockaddr_in *Exclude, size_t Limit = Fanout)
+    {
+        const auto Messagetype = reinterpret_cast<const Header_t *>(Message.data())->Messagetype;
+        const auto Targets = Selectpeers(Exclude, Messagetype, Limit);
+        if (Targets.empty()) return;
+
+        Blob_t Frame{};
+        Frame.reserve(Overhead + Message.size());
+        Frame.append(reinterpret_cast<const uint8_t *>(&Gossipmagic), sizeof(Gossipmagic));
+        Frame.push_back(TTL);
+        Frame.append(Message.data(), Message.size());
+
+        for (const auto &Target : Targets)
+        {
+            if (SOCKET_ERROR == sendto(Gossipsocket, (const char *)Frame.data(), (int)Frame.size(), NULL, (const sockaddr *)&Target, sizeof(Target))) [[unlikely]]
+                Senderrors.fetch_add(1, std::memory_order_relaxed);
+            else
+                Framessent.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    // Registered as the WAN transport.
+    static void __cdecl Publish(const Blob_t &Packet)
+    {
+        if (Packet.size() < sizeof(Header_t)) [[unlikely]] return;
+
+        // Needs to fit a single datagram.
+        if (Packet.size() + Overhead > 0xFFE3) [[unlikely]]
+        {
+            Oversized.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        // So that echoes are not forwarded again.
+        {
+            std::scoped_lock Guard(Seenlock);
+            Seen.insert(Hash::WW64(Packet.data(), Packet.size()));
+        }
+
+        // Advertisements are only for the direct peers.
+        if (reinterpret_cast<const Header_t *>(Packet.data())->Messagetype == Interesttype)
+            return Gossip(Packet, 1, nullptr, Maxpeers);
+
+        Gossip(Packet, uint8_t(Hoplimit), nullptr);
+    }
+
+    // Forwarded before verification, the next hop verifies on its own.
+    static void Ingest(Sharedbuffer_t &&Frame, const sockaddr_in &Sender)
+    {
+        if (Frame.size() < Overhead + sizeof(Header_t)) [[unlikely]] return;
+        if (std::memcmp(Frame.data(), &Gossipmagic, sizeof(Gossipmagic))) [[unlikely]] return;
+
+        // Whatever the sender claims, we don't forward further than our own limit.
+        const auto TTL = std::min(uint32_t(Frame.data()[sizeof(Gossipmagic)]), Hoplimit);
+        auto Message = Frame.subspan(Overhead);
+        Framesreceived.fetch_add(1, std::memory_order_relaxed);
+
+        {
+            std::scoped_lock Guard(Seenlock);
+            if (Seen.testandSet(Hash::WW64(Message.data(), Message.size())))
+            {
+                Duplicates.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+        }
+
+        // Anyone that sends us valid messages can be gossiped to.
+        const auto isKnown = Touchpeer(Sender) || Learnpeer(Sender, Message);
+
+        // Unverified, but a false claim only changes what the claimant is sent.
+        const auto Header = reinterpret_cast<const Header_t *>(Message.data());
+        if (isKnown && TTL == 1 && Header->Messagetype == Interesttype)
+        {
+            std::scoped_lock Guard(Peerlock);
+            if (Peerkeys.size() < Maxpeers || Peerkeys.contains(Addresskey(Sender))) Peerkeys[Addresskey(Sender)] = Header->Publickey;
+        }
+
+        if (TTL > 1)
+        {
+            Gossip(Message, uint8_t(TTL - 1), &Sender);
+            Forwarded.fetch_add(1, std::memory_order_relaxed);
+        }
+        else Expired.fetch_add(1, std::memory_order_relaxed);
+
+        Receive(std::move(Message));
+    }
+
+    // Blocks in recvfrom, the socket is only used by us.
+    static void Receivethread()
+    {
+        // Name this thread for easier debugging.
+        setThreadname("Ayria_WANReceive");
+
+        while (true)
+        {
+            auto Buffer = Receivepool.Acquire();
+            sockaddr_in Sender{};
+            socklen_t Sendersize = sizeof(Sender);
+
+            // Windows reports ICMP errors from earlier sends here, so just try again.
+            const auto Packetsize = recvfrom(Gossipsocket, (char *)Buffer.data(), int(Buffer.size()), NULL, (sockaddr *)&Sender, &Sendersize);
+            if (Packetsize <= 0) [[unlikely]] continue;
+
+            Buffer.resize(Packetsize);
+            Ingest(std::move(Buffer), Sender);
+        }
+    }
+
+    // On startup.
+    static void __cdecl Initialize()
+    {
+        const auto &Settings = Config::getSettings();
+        Gossipport = std::clamp(Settings.value<uint32_t>("WANPort", Gossipport), 1U, 0xFFFFU);
+        Fanout = std::clamp(Settings.value<uint32_t>("WANFanout", Fanout), 1U, 16U);
+        Hoplimit = std::clamp(Settings.value<uint32_t>("WANHoplimit", Hoplimit), 1U, 255U);
+        Peertimeout = std::max(Settings.value<uint32_t>("WANPeertimeout", Peertimeout), 10000U);
+
+        // Several clients on one machine need different ports.
+        sockaddr_in Localhost{};
+        Localhost.sin_family = AF_INET;
+        Localhost.sin_port = cmp::toBig(uint16_t(Gossipport));
+        WSADATA Unused;
+
+        (void)WSAStartup(MAKEWORD(1, 1), &Unused);
+        Gossipsocket = socket(AF_INET, SOCK_DGRAM, 0);
+        if (bind(Gossipsocket, (sockaddr *)&Localhost, sizeof(Localhost))) [[unlikely]]
+        {
+            Infoprint(va("WAN: could not bind port %u, gossip is disabled.", Gossipport));
+            closesocket(Gossipsocket);
+            return;
+        }
+
+        for (const auto &Address : Settings.value<std::vector<std::string>>("WANPeers"))
+        {
+            sockaddr_in Peer{};
+            if (Parsepeer(Address, Peer)) Addpeer(Peer, true);
+            else Infoprint(va("WAN: invalid peer \"%s\", expected IPv4:Port.", Address.c_str()));
+        }
+
+        std::thread(Receivethread).detach();
+        Register(Scope_t::WAN, Publish);
+        Enqueuetask(Prunepeers, 10000);
+
+        // Peers can also be added at runtime, e.g. for testing.
+        static constexpr auto Addpeercommand = [](int Argc, const char **Argv)
+        {
+            for (int i = 0; i < Argc; ++i)
+            {
+                sockaddr_in Peer{};
+                if (Parsepeer(Argv[i], Peer)) Addpeer(Peer, true);
+                else Infoprint(va("WAN: invalid peer \"%s\", expected IPv4:Port.", Argv[i]));
+            }
+        };
+        Communication::Console::addCommand(u8"WANpeer", Addpeercommand);
+
+        static constexpr auto Printstats = [](int, const char **)
+        {
+            size_t Peercount{};
+            {
+                std::scoped_lock Guard(Peerlock);
+                Peercount = Peers.size();
+            }
+
+            Infoprint(va("WAN gossip: %zu peers, %llu sent, %llu received, %llu forwarded, %llu duplicates, %llu expired, %llu oversized, %llu errors, %llu uninterested",
+                         Peercount, Framessent.load(), Framesreceived.load(), Forwarded.load(), Duplicates.load(), Expired.load(), Oversized.load(), Senderrors.load(), Uninterested.load()));
+            Infoprint(va("WAN gossip: %llu peers learned, %llu evicted", Learned.load(), Evicted.load()));
+        };
+        Communication::Console::addCommand(u8"WANstats", Printstats);
+    }
+
+    // Register initialization to run on startup.
+    struct Startup_t { Startup_t() { Backgroundtasks::addStartuptask(Initialize); } } Startup{};
+}
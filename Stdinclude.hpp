@@ -13,6 +13,7 @@
 #pragma warning(push, 0)
 
 // Standard-library includes for all projects in this repository.
+#include <condition_variable>
 #include <memory_resource>
 #include <unordered_map>
 #include <unordered_set>
@@ -57,12 +58,18 @@
 #include <intrin.h>
 #include <direct.h>
 #else
+#include <netinet/in.h>
+#include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <dlfcn.h>
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
 #endif
 
 // Restore warnings.
@@ -0,0 +1,189 @@
+/*
+    Initial author: Convery (tcn@ayria.se)
+    Started: 2023-03-24
+    License: MIT
+
+    Reference counted views into pre-allocated buffers.
+    Copies share the buffer, which goes back to the pool when the last view is released.
+*/
+
+#pragma once
+#include <Utilities/Utilities.hpp>
+#include "MPSCQueue.hpp"
+
+class Sharedbuffer_t
+{
+    public:
+    // Pooled blocks are handed back via Recycle, others are freed.
+    struct Block_t
+    {
+        std::atomic<uint32_t> References{};
+        void(*Recycle)(void *Owner, Block_t *Block){};
+        void *Owner{};
+        uint8_t *Storage{};
+        size_t Capacity{};
+    };
+
+    private:
+    Block_t *Block{};
+    size_t Offset{}, Length{};
+
+    void Release() noexcept
+    {
+        if (!Block || Block->References.fetch_sub(1, std::memory_order_acq_rel) != 1)
+            return;
+
+        if (Block->Recycle) Block->Recycle(Block->Owner, Block);
+        else
+        {
+            delete[] Block->Storage;
+            delete Block;
+        }
+    }
+
+    public:
+    using value_type = uint8_t;
+
+    // Takes the first reference to an unused block.
+    Sharedbuffer_t() = default;
+    explicit Sharedbuffer_t(Block_t *Unused) noexcept : Block(Unused), Length(Unused->Capacity)
+    {
+        Block->References.store(1, std::memory_order_relaxed);
+    }
+
+    Sharedbuffer_t(const Sharedbuffer_t &Other) noexcept : Block(Other.Block), Offset(Other.Offset), Length(Other.Length)
+    {
+        if (Block) Block->References.fetch_add(1, std::memory_order_relaxed);
+    }
+    Sharedbuffer_t(Sharedbuffer_t &&Other) noexcept
+    {
+        swap(Other);
+    }
+    Sharedbuffer_t &operator=(Sharedbuffer_t Other) noexcept
+    {
+        swap(Other);
+        return *this;
+    }
+    ~Sharedbuffer_t()
+    {
+        Release();
+    }
+
+    void swap(Sharedbuffer_t &Other) noexcept
+    {
+        std::swap(Block, Other.Block);
+        std::swap(Offset, Other.Offset);
+        std::swap(Length, Other.Length);
+    }
+
+    // Outside of any pool, e.g. for reassembled messages.
+    [[nodiscard]] static Sharedbuffer_t Allocate(size_t Size)
+    {
+        const auto Block = new Block_t{};
+        Block->Storage = new uint8_t[Size];
+        Block->Capacity = Size;
+        return Sharedbuffer_t(Block);
+    }
+    [[nodiscard]] static Sharedbuffer_t Copy(std::span<const uint8_t> Input)
+    {
+        auto Result = Allocate(Input.size());
+        std::memcpy(Result.data(), Input.data(), Input.size());
+        return Result;
+    }
+
+    // Another reference to part of the same buffer.
+    [[nodiscard]] Sharedbuffer_t subspan(size_t Position, size_t Count = std::dynamic_extent) const
+    {
+        Position = std::min(Position, Length);
+
+        auto Result = *this;
+        Result.Offset += Position;
+        Result.Length = std::min(Count, Length - Position);
+        return Result;
+    }
+
+    // Can only shrink the view, e.g. to the size actually received.
+    void resize(size_t Size) noexcept
+    {
+        Length = std::min(Size, Length);
+    }
+
+    // Writing is only safe before the buffer is shared.
+    [[nodiscard]] uint8_t *data() noexcept { return Block ? Block->Storage + Offset : nullptr; }
+    [[nodiscard]] const uint8_t *data() const noexcept { return Block ? Block->Storage + Offset : nullptr; }
+    [[nodiscard]] const uint8_t *begin() const noexcept { return data(); }
+    [[nodiscard]] const uint8_t *end() const noexcept { return data() + Length; }
+    [[nodiscard]] size_t size() const noexcept { return Length; }
+    [[nodiscard]] bool empty() const noexcept { return !Length; }
+
+    // Approximate when shared between threads.
+    [[nodiscard]] uint32_t use_count() const noexcept
+    {
+        return Block ? Block->References.load(std::memory_order_relaxed) : 0;
+    }
+
+    operator std::span<const uint8_t>() const noexcept { return { data(), Length }; }
+};
+
+// Buffers are acquired from a single thread and released from any, the pool needs to outlive them.
+template <size_t Buffersize, size_t Count> requires (Buffersize > 0 && Count > 1 && std::has_single_bit(Count))
+class Bufferpool_t
+{
+    std::unique_ptr<uint8_t[]> Slab{ new uint8_t[Buffersize * Count] };
+    std::unique_ptr<Sharedbuffer_t::Block_t[]> Blocks{ new Sharedbuffer_t::Block_t[Count]{} };
+    MPSCQueue_t<Sharedbuffer_t::Block_t *, Count> Available{};
+    std::atomic<uint64_t> Acquired{}, Fallbacks{};
+
+    // There's a slot for every block, so this can't fail.
+    static void Recycle(void *Owner, Sharedbuffer_t::Block_t *Block)
+    {
+        (void)static_cast<Bufferpool_t *>(Owner)->Available.try_push(Block);
+    }
+
+    public:
+    struct Statistics_t { uint64_t Acquired, Fallbacks; size_t Available; };
+
+    Bufferpool_t()
+    {
+        for (size_t i = 0; i < Count; ++i)
+        {
+            Blocks[i].Recycle = Recycle;
+            Blocks[i].Owner = this;
+            Blocks[i].Storage = Slab.get() + i * Buffersize;
+            Blocks[i].Capacity = Buffersize;
+
+            (void)Available.try_push(&Blocks[i]);
+        }
+    }
+
+    // The blocks point back to the pool.
+    Bufferpool_t(const Bufferpool_t &) = delete;
+    Bufferpool_t &operator=(const Bufferpool_t &) = delete;
+
+    // Falls back to the heap when all buffers are in use.
+    [[nodiscard]] Sharedbuffer_t Acquire()
+    {
+        Sharedbuffer_t::Block_t *Block{};
+        Available.drain([&](Sharedbuffer_t::Block_t *&&Item) { Block = Item; }, 1);
+
+        if (!Block) [[unlikely]]
+        {
+            Fallbacks.fetch_add(1, std::memory_order_relaxed);
+            return Sharedbuffer_t::Allocate(Buffersize);
+        }
+
+        Acquired.fetch_add(1, std::memory_order_relaxed);
+        return Sharedbuffer_t(Block);
+    }
+
+    [[nodiscard]] static constexpr size_t buffersize() noexcept
+    {
+        return Buffersize;
+    }
+
+    // Safe to call from any thread.
+    [[nodiscard]] Statistics_t getStatistics() const noexcept
+    {
+        return { Acquired.load(std::memory_order_relaxed), Fallbacks.load(std::memory_order_relaxed), Available.size() };
+    }
+};
@@ -0,0 +1,131 @@
+/*
+    Initial author: Convery (tcn@ayria.se)
+    Started: 2023-03-16
+    License: MIT
+
+    Fixed capacity queue for many producers and a single consumer.
+    Producers claim a slot with a single CAS, the consumer drains in place.
+    Based on Dmitry Vyukov's bounded queue, with statistics for tuning.
+*/
+
+#pragma once
+#include <Utilities/Utilities.hpp>
+
+template <typename T, size_t N> requires (N > 1 && std::has_single_bit(N))
+class MPSCQueue_t
+{
+    // Sequence == Index when free, Index + 1 when filled.
+    struct alignas(64) Slot_t
+    {
+        std::atomic<size_t> Sequence;
+        T Value;
+    };
+    std::unique_ptr<Slot_t[]> Slots{ new Slot_t[N]{} };
+
+    // Separate cache-lines to avoid false sharing between producers and the consumer.
+    alignas(64) std::atomic<size_t> Tail{};
+    alignas(64) std::atomic<size_t> Head{};
+    alignas(64) std::atomic<uint64_t> Rejected{};
+    std::atomic<size_t> Highwater{};
+
+    public:
+    struct Statistics_t { uint64_t Pushed, Rejected; size_t Highwater, Size; };
+
+    MPSCQueue_t()
+    {
+        for (size_t i = 0; i < N; ++i)
+            Slots[i].Sequence.store(i, std::memory_order_relaxed);
+    }
+
+    // Returns false if the queue is full, callers decide if they want to retry or drop.
+    template <typename... Args> [[nodiscard]] bool try_emplace(Args&&... args)
+    {
+        auto Position = Tail.load(std::memory_order_relaxed);
+        Slot_t *Slot{};
+
+        while (true)
+        {
+            Slot = &Slots[Position & (N - 1)];
+            const auto Sequence = Slot->Sequence.load(std::memory_order_acquire);
+            const auto Difference = intptr_t(Sequence) - intptr_t(Position);
+
+            // Free slot, try to claim it.
+            if (Difference == 0) [[likely]]
+            {
+                if (Tail.compare_exchange_weak(Position, Position + 1, std::memory_order_relaxed))
+                    break;
+            }
+
+            // The consumer has not caught up.
+            else if (Difference < 0)
+            {
+                Rejected.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+
+            // Another producer got here first.
+            else Position = Tail.load(std::memory_order_relaxed);
+        }
+
+        // The consumer can't pass our slot until it's published, so Head <= Position here.
+        const auto Depth = Position + 1 - Head.load(std::memory_order_relaxed);
+
+        Slot->Value = T{ std::forward<Args>(args)... };
+        Slot->Sequence.store(Position + 1, std::memory_order_release);
+
+        // Rarely written, so mostly a shared read.
+        auto Previous = Highwater.load(std::memory_order_relaxed);
+        while (Depth > Previous && !Highwater.compare_exchange_weak(Previous, Depth, std::memory_order_relaxed)) {}
+
+        return true;
+    }
+    [[nodiscard]] bool try_push(T &&Value) { return try_emplace(std::move(Value)); }
+    [[nodiscard]] bool try_push(const T &Value) { return try_emplace(Value); }
+
+    // Consumer only, the callback gets ownership of each item; returns the number processed.
+    template <typename F> size_t drain(F &&Callback, size_t Limit = N)
+    {
+        auto Position = Head.load(std::memory_order_relaxed);
+        size_t Count{};
+
+        while (Count < Limit)
+        {
+            auto &Slot = Slots[Position & (N - 1)];
+            if (Slot.Sequence.load(std::memory_order_acquire) != Position + 1)
+                break;
+
+            Callback(std::move(Slot.Value));
+
+            // Release any resources before handing the slot back.
+            Slot.Value = T{};
+            Slot.Sequence.store(Position + N, std::memory_order_release);
+
+            ++Position; ++Count;
+            Head.store(Position, std::memory_order_relaxed);
+        }
+
+        return Count;
+    }
+
+    // Approximate when producers are active.
+    [[nodiscard]] size_t size() const noexcept
+    {
+        const auto Last = Tail.load(std::memory_order_relaxed);
+        const auto First = Head.load(std::memory_order_relaxed);
+        return Last > First ? std::min(Last - First, N) : 0;
+    }
+    [[nodiscard]] bool empty() const noexcept
+    {
+        return size() == 0;
+    }
+    [[nodiscard]] static constexpr size_t capacity() noexcept
+    {
+        return N;
+    }
+
+    // Safe to call from any thread.
+    [[nodiscard]] Statistics_t getStatistics() const noexcept
+    {
+        return { Tail.load(std::memory_order_relaxed), Rejected.load(std::memory_order_relaxed), Highwater.load(std::memory_order_relaxed), size() };
+    }
+};
@@ -0,0 +1,148 @@
+/*
+    Initial author: Convery (tcn@ayria.se)
+    Started: 2023-03-15
+    License: MIT
+
+    Fixed capacity set for recently seen keys.
+    A blocked Bloom filter rejects most new keys in a single cache-line,
+    and an exact LRU confirms the hits so false positives are never dropped.
+*/
+
+#pragma once
+#include <Utilities/Utilities.hpp>
+
+template <typename T, size_t N> requires (N > 0 && N < UINT32_MAX)
+class Seenfilter_t
+{
+    // ~16 bits per key, 4 bits set per key in one 512-bit block.
+    static constexpr size_t Blockcount = std::bit_ceil((N + 31) / 32);
+    static constexpr uint32_t Invalid = UINT32_MAX;
+    using Block_t = std::array<uint64_t, 8>;
+
+    struct Node_t
+    {
+        T Key;
+        uint32_t Prev, Next;
+    };
+
+    // Two generations so that the filter never forgets what the LRU remembers.
+    std::unique_ptr<Block_t[]> Current{ new Block_t[Blockcount]{} }, Previous{ new Block_t[Blockcount]{} };
+    std::unique_ptr<Node_t[]> Nodes{ new Node_t[N]{} };
+    Hashmap<T, uint32_t, decltype(WW64::Hash)> Index{};
+    uint32_t Head{ Invalid }, Tail{ Invalid };
+    uint32_t Used{}, Generation{};
+
+    // Relaxed as they are only informational.
+    std::atomic<uint64_t> Hits{}, Falsepositives{}, Inserts{};
+
+    // Test (and optionally set) the 4 bits for a key.
+    static bool Probe(Block_t *Blocks, uint64_t Hash, bool Set) noexcept
+    {
+        auto &Block = Blocks[Hash & (Blockcount - 1)];
+        bool Found = true;
+
+        for (uint8_t i = 0; i < 4; ++i)
+        {
+            const auto Bit = (Hash >> (16 + i * 9)) & 511;
+            const auto Mask = 1ULL << (Bit & 63);
+
+            Found &= !!(Block[Bit >> 6] & Mask);
+            if (Set) Block[Bit >> 6] |= Mask;
+        }
+
+        return Found;
+    }
+
+    // Intrusive list, most recently seen at the head.
+    void Unlink(uint32_t Slot) noexcept
+    {
+        const auto &Node = Nodes[Slot];
+
+        if (Node.Prev != Invalid) Nodes[Node.Prev].Next = Node.Next;
+        else Head = Node.Next;
+
+        if (Node.Next != Invalid) Nodes[Node.Next].Prev = Node.Prev;
+        else Tail = Node.Prev;
+    }
+    void Pushfront(uint32_t Slot) noexcept
+    {
+        Nodes[Slot].Prev = Invalid;
+        Nodes[Slot].Next = Head;
+
+        if (Head != Invalid) Nodes[Head].Prev = Slot;
+        if (Tail == Invalid) Tail = Slot;
+        Head = Slot;
+    }
+
+    public:
+    struct Statistics_t { uint64_t Hits, Falsepositives, Inserts; };
+
+    Seenfilter_t() { Index.reserve(N); }
+
+    // Returns true if the key has been seen recently.
+    [[nodiscard]] bool contains(const T &Key)
+    {
+        const auto Hash = WW64::Hash(Key);
+
+        // Most new keys stop here.
+        if (!Probe(Current.get(), Hash, false) && !Probe(Previous.get(), Hash, false)) [[likely]]
+            return false;
+
+        if (const auto Item = Index.find(Key); Item != Index.end())
+        {
+            Hits.fetch_add(1, std::memory_order_relaxed);
+            Probe(Current.get(), Hash, true);
+
+            Unlink(Item->second);
+            Pushfront(Item->second);
+            return true;
+        }
+
+        Falsepositives.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    // Evicts the least recently seen key when full.
+    void insert(const T &Key)
+    {
+        if (Index.contains(Key)) return;
+        Inserts.fetch_add(1, std::memory_order_relaxed);
+
+        // Rotate the filter once a full LRU has been inserted.
+        if (++Generation >= N)
+        {
+            std::swap(Current, Previous);
+            std::fill_n(Current.get(), Blockcount, Block_t{});
+            Generation = 0;
+        }
+        Probe(Current.get(), WW64::Hash(Key), true);
+
+        uint32_t Slot{};
+        if (Used < N) Slot = Used++;
+        else
+        {
+            Slot = Tail;
+            Unlink(Slot);
+            Index.erase(Nodes[Slot].Key);
+        }
+
+        Nodes[Slot].Key = Key;
+        Index.emplace(Key, Slot);
+        Pushfront(Slot);
+    }
+
+    // Convenience for single-stage users.
+    [[nodiscard]] bool testandSet(const T &Key)
+    {
+        if (contains(Key)) return true;
+
+        insert(Key);
+        return false;
+    }
+
+    // Safe to call from other threads.
+    [[nodiscard]] Statistics_t getStatistics() const noexcept
+    {
+        return { Hits.load(std::memory_order_relaxed), Falsepositives.load(std::memory_order_relaxed), Inserts.load(std::memory_order_relaxed) };
+    }
+};
@@ -0,0 +1,56 @@
+/*
+    Initial author: Convery (tcn@ayria.se)
+    Started: 2023-04-04
+    License: MIT
+
+    Order-independent summary of a set of 64-bit IDs, for comparing sets between peers.
+    Equal sets always match; on a mismatch the peers exchange sorted inventories in chunks,
+    and whoever has IDs that fall within a chunk's range without being listed sends them.
+*/
+
+#pragma once
+#include <Utilities/Utilities.hpp>
+
+struct Setdigest_t
+{
+    uint32_t Count{};
+    uint64_t Digest{};
+
+    // XOR, so the order of inserts and merges does not matter.
+    void insert(uint64_t ID) noexcept { ++Count; Digest ^= ID; }
+    void merge(const Setdigest_t &Other) noexcept { Count += Other.Count; Digest ^= Other.Digest; }
+
+    bool operator==(const Setdigest_t &) const = default;
+
+    // The ranges are contiguous so that the receiver sees the whole ID-space, an empty set is a single empty chunk.
+    struct Chunk_t
+    {
+        uint64_t Low, High;
+        std::span<const uint64_t> IDs;
+    };
+    static std::vector<Chunk_t> Chunk(std::span<const uint64_t> Sorted, size_t Chunksize)
+    {
+        std::vector<Chunk_t> Result{};
+        size_t Offset{};
+
+        // Would never advance.
+        Chunksize = std::max<size_t>(Chunksize, 1);
+
+        do
+        {
+            const auto Count = std::min(Chunksize, Sorted.size() - Offset);
+            const auto isLast = (Offset + Count) == Sorted.size();
+
+            Result.push_back({ Offset ? Sorted[Offset - 1] + 1 : 0, isLast ? UINT64_MAX : Sorted[Offset + Count - 1], Sorted.subspan(Offset, Count) });
+            Offset += Count;
+        } while (Offset < Sorted.size());
+
+        return Result;
+    }
+
+    // True if the ID is within the chunk's range but not listed, i.e. the peer lacks it.
+    static bool Lacks(const Chunk_t &Remote, uint64_t ID)
+    {
+        return ID >= Remote.Low && ID <= Remote.High && !std::ranges::binary_search(Remote.IDs, ID);
+    }
+};
@@ -0,0 +1,300 @@
+/*
+    Initial author: Convery (tcn@ayria.se)
+    Started: 2023-04-05
+    License: MIT
+
+    Wire framing for the transports, kept separate from the sockets so it can be tested.
+    Bundles: Magic, then [uint16_t Size, Message] until the end.
+    Fragments: Magic, Fragmentheader_t, then a slice of the message.
+    Compact: Magic, Flags, Signature, then the Publickey and a varint epoch or an 8-byte ShortID,
+    then the Messagetype and Timestamp - epoch as varints, then the payload.
+*/
+
+#pragma once
+#include <Utilities/Utilities.hpp>
+
+namespace Framing
+{
+    constexpr uint32_t Bundlemagic = Hash::WW32("Ayria::Bundle");
+    constexpr size_t Bundleoverhead = sizeof(Bundlemagic) + sizeof(uint16_t);
+
+    inline bool isBundle(std::span<const uint8_t> Datagram)
+    {
+        return Datagram.size() >= sizeof(Bundlemagic) && !std::memcmp(Datagram.data(), &Bundlemagic, sizeof(Bundlemagic));
+    }
+
+    // The magic is written with the first message, the caller checks the size.
+    inline void Appendbundle(Blob_t &Bundle, std::span<const uint8_t> Message)
+    {
+        if (Bundle.empty()) Bundle.append(reinterpret_cast<const uint8_t *>(&Bundlemagic), sizeof(Bundlemagic));
+
+        const auto Size = uint16_t(Message.size());
+        Bundle.append(reinterpret_cast<const uint8_t *>(&Size), sizeof(Size));
+        Bundle.append(Message.data(), Size);
+    }
+
+    // Callback(Offset, Size) for every message, parsing stops at the first truncated one.
+    template <typename F> requires std::invocable<F, size_t, size_t>
+    size_t Unbundle(std::span<const uint8_t> Datagram, F &&Callback)
+    {
+        if (!isBundle(Datagram)) return 0;
+
+        size_t Offset = sizeof(Bundlemagic), Count{};
+        while (Offset + sizeof(uint16_t) <= Datagram.size())
+        {
+            uint16_t Length{};
+            std::memcpy(&Length, Datagram.data() + Offset, sizeof(Length));
+            Offset += sizeof(Length);
+
+            if (Offset + Length > Datagram.size()) [[unlikely]] break;
+            Callback(Offset, size_t(Length));
+            Offset += Length;
+            ++Count;
+        }
+
+        return Count;
+    }
+
+    constexpr uint32_t Fragmentmagic = Hash::WW32("Ayria::Fragment");
+    #pragma pack(push, 1)
+    struct Fragmentheader_t
+    {
+        uint64_t MessageID;
+        uint32_t Totalsize, Offset;
+        uint16_t Index, Count;
+    };
+    #pragma pack(pop)
+    constexpr size_t Fragmentoverhead = sizeof(Fragmentmagic) + sizeof(Fragmentheader_t);
+
+    inline bool isFragment(std::span<const uint8_t> Datagram)
+    {
+        return Datagram.size() >= sizeof(Fragmentmagic) && !std::memcmp(Datagram.data(), &Fragmentmagic, sizeof(Fragmentmagic));
+    }
+
+    // The caller checks that the message needs splitting, and that Maxdatagram is larger than the overhead.
+    inline std::vector<Blob_t> Fragment(std::span<const uint8_t> Message, uint64_t MessageID, size_t Maxdatagram)
+    {
+        const auto Slicesize = Maxdatagram - Fragmentoverhead;
+        const auto Count = uint16_t((Message.size() + Slicesize - 1) / Slicesize);
+        std::vector<Blob_t> Frames{};
+        Frames.reserve(Count);
+
+        for (uint16_t i = 0; i < Count; ++i)
+        {
+            const auto Offset = i * Slicesize;
+            const Fragmentheader_t Header{ MessageID, uint32_t(Message.size()), uint32_t(Offset), i, Count };
+
+            auto &Frame = Frames.emplace_back();
+            Frame.reserve(Maxdatagram);
+            Frame.append(reinterpret_cast<const uint8_t *>(&Fragmentmagic), sizeof(Fragmentmagic));
+            Frame.append(reinterpret_cast<const uint8_t *>(&Header), sizeof(Header));
+            Frame.append(Message.data() + Offset, std::min(Slicesize, Message.size() - Offset));
+        }
+
+        return Frames;
+    }
+
+    // Not thread-safe, the transport keeps one per receiving thread.
+    class Reassembler_t
+    {
+        struct Partial_t
+        {
+            Sharedbuffer_t Data;
+            std::vector<bool> Received;
+            uint32_t Slicesize;
+            uint16_t Remaining;
+            std::chrono::steady_clock::time_point Deadline;
+        };
+        Hashmap<uint64_t, Partial_t> Partials{};
+        size_t Buffered{};
+
+        public:
+        struct Limits_t
+        {
+            size_t Minmessage, Maxmessage, Budget;
+            std::chrono::milliseconds Timeout;
+        };
+
+        // The message is empty until the last fragment arrives.
+        struct Result_t
+        {
+            Sharedbuffer_t Message;
+            uint32_t Expired, Evicted;
+        };
+
+        Result_t Insert(std::span<const uint8_t> Frame, const Limits_t &Limits, std::chrono::steady_clock::time_point Now)
+        {
+            Result_t Result{};
+            if (!isFragment(Frame) || Frame.size() < Fragmentoverhead) [[unlikely]] return Result;
+
+            Fragmentheader_t Header;
+            std::memcpy(&Header, Frame.data() + sizeof(Fragmentmagic), sizeof(Header));
+            const auto Slice = Frame.subspan(Fragmentoverhead);
+
+            // Malformed, or more than we are willing to buffer.
+            if (Header.Count < 2 || Header.Index >= Header.Count || Header.Totalsize < Limits.Minmessage || Header.Totalsize > Limits.Maxmessage) [[unlikely]] return Result;
+            if (uint64_t(Header.Offset) + Slice.size() > Header.Totalsize) [[unlikely]] return Result;
+
+            // The slices must tile the message exactly, as the buffer is not initialized; only the last one may be shorter.
+            const auto isLast = Header.Index == Header.Count - 1;
+            const auto Slicesize = isLast ? Header.Offset / Header.Index : uint32_t(Slice.size());
+            if (!Slicesize || uint64_t(Header.Index) * Slicesize != Header.Offset) [[unlikely]] return Result;
+            if ((uint64_t(Header.Totalsize) + Slicesize - 1) / Slicesize != Header.Count) [[unlikely]] return Result;
+            if (Slice.size() != std::min<uint64_t>(Slicesize, Header.Totalsize - Header.Offset)) [[unlikely]] return Result;
+
+            auto Entry = Partials.find(Header.MessageID);
+            if (Entry == Partials.end())
+            {
+                // Lost fragments are not retransmitted, so give up on stale messages.
+                for (auto It = Partials.begin(); It != Partials.end();)
+                {
+                    if (It->second.Deadline > Now) { ++It; continue; }
+
+                    Buffered -= It->second.Data.size();
+                    ++Result.Expired;
+                    Partials.erase(It++);
+                }
+
+                // Still too much in flight, drop the oldest.
+                while (!Partials.empty() && Buffered + Header.Totalsize > Limits.Budget)
+                {
+                    const auto Oldest = std::ranges::min_element(Partials, {}, [](const auto &Item) { return Item.second.Deadline; });
+                    Buffered -= Oldest->second.Data.size();
+                    ++Result.Evicted;
+                    Partials.erase(Oldest);
+                }
+
+                Partial_t Partial{ Sharedbuffer_t::Allocate(Header.Totalsize), std::vector<bool>(Header.Count), Slicesize, Header.Count, Now + Limits.Timeout };
+                Entry = Partials.emplace(Header.MessageID, std::move(Partial)).first;
+                Buffered += Header.Totalsize;
+            }
+
+            // Must agree with the first fragment, duplicates are ignored.
+            auto &Partial = Entry->second;
+            if (Partial.Data.size() != Header.Totalsize || Partial.Received.size() != Header.Count || Partial.Slicesize != Slicesize) [[unlikely]] return Result;
+            if (Partial.Received[Header.Index]) return Result;
+
+            std::memcpy(Partial.Data.data() + Header.Offset, Slice.data(), Slice.size());
+            Partial.Received[Header.Index] = true;
+            if (--Partial.Remaining) return Result;
+
+            // Complete.
+            Result.Message = std::move(Partial.Data);
+            Buffered -= Result.Message.size();
+            Partials.erase(Entry);
+            return Result;
+        }
+
+        [[nodiscard]] size_t size() const noexcept { return Partials.size(); }
+        [[nodiscard]] size_t bytes() const noexcept { return Buffered; }
+    };
+
+    constexpr uint32_t Compactmagic = Hash::WW32("Ayria::Compact");
+    enum Compactflags_t : uint8_t { Fullkey = 1 << 0, Announce = 1 << 1 };
+
+    // The Publickey is only sent with Fullkey, the ShortID without.
+    struct Compactheader_t
+    {
+        uint8_t Flags;
+        qDSA::Signature_t Signature;
+        qDSA::Publickey_t Publickey;
+        uint64_t ShortID;
+        int64_t Epoch;
+        uint32_t Messagetype;
+        int64_t Timestamp;
+    };
+
+    // LEB128, little end first.
+    inline void Writevarint(Blob_t &Output, uint64_t Value)
+    {
+        do
+        {
+            Output.push_back(uint8_t(Value & 0x7F) | (Value > 0x7F ? 0x80 : 0));
+            Value >>= 7;
+        } while (Value);
+    }
+    inline bool Readvarint(std::span<const uint8_t> &Input, uint64_t &Value)
+    {
+        Value = 0;
+
+        for (uint8_t i = 0; i < 10 && !Input.empty(); ++i)
+        {
+            const auto Byte = Input.front();
+            Input = Input.subspan(1);
+
+            Value |= uint64_t(Byte & 0x7F) << (7 * i);
+            if (!(Byte & 0x80)) return true;
+        }
+
+        return false;
+    }
+
+    inline bool isCompact(std::span<const uint8_t> Datagram)
+    {
+        return Datagram.size() >= sizeof(Compactmagic) && !std::memcmp(Datagram.data(), &Compactmagic, sizeof(Compactmagic));
+    }
+
+    inline Blob_t Encodecompact(const Compactheader_t &Header, std::span<const uint8_t> Payload)
+    {
+        Blob_t Result{};
+        Result.reserve(sizeof(Compactmagic) + 1 + sizeof(Header.Signature) + sizeof(Header.Publickey) + 30 + Payload.size());
+        Result.append(reinterpret_cast<const uint8_t *>(&Compactmagic), sizeof(Compactmagic));
+        Result.push_back(Header.Flags);
+        Result.append(Header.Signature.data(), Header.Signature.size());
+
+        if (Header.Flags & Fullkey)
+        {
+            Result.append(Header.Publickey.data(), Header.Publickey.size());
+            Writevarint(Result, uint64_t(Header.Epoch));
+        }
+        else
+        {
+            Result.append(reinterpret_cast<const uint8_t *>(&Header.ShortID), sizeof(Header.ShortID));
+        }
+
+        Writevarint(Result, Header.Messagetype);
+        Writevarint(Result, uint64_t(Header.Timestamp - Header.Epoch));
+        Result.append(Payload.data(), Payload.size());
+        return Result;
+    }
+
+    // Lookup(ShortID, Publickey &, Epoch &) resolves senders without the full key, false if malformed or unknown.
+    template <typename F> requires std::is_invocable_r_v<bool, F, uint64_t, qDSA::Publickey_t &, int64_t &>
+    bool Decodecompact(std::span<const uint8_t> Frame, Compactheader_t &Header, std::span<const uint8_t> &Payload, F &&Lookup)
+    {
+        if (!isCompact(Frame)) return false;
+
+        auto Input = Frame.subspan(sizeof(Compactmagic));
+        if (Input.size() < 1 + sizeof(Header.Signature) + sizeof(Header.ShortID)) [[unlikely]] return false;
+
+        Header.Flags = Input[0];
+        std::memcpy(Header.Signature.data(), Input.data() + 1, sizeof(Header.Signature));
+        Input = Input.subspan(1 + sizeof(Header.Signature));
+
+        if (Header.Flags & Fullkey)
+        {
+            if (Input.size() < sizeof(Header.Publickey)) [[unlikely]] return false;
+            std::memcpy(Header.Publickey.data(), Input.data(), sizeof(Header.Publickey));
+            Input = Input.subspan(sizeof(Header.Publickey));
+
+            uint64_t Epoch{};
+            if (!Readvarint(Input, Epoch)) [[unlikely]] return false;
+            Header.Epoch = int64_t(Epoch);
+        }
+        else
+        {
+            std::memcpy(&Header.ShortID, Input.data(), sizeof(Header.ShortID));
+            Input = Input.subspan(sizeof(Header.ShortID));
+
+            if (!Lookup(Header.ShortID, Header.Publickey, Header.Epoch)) return false;
+        }
+
+        uint64_t Messagetype{}, Delta{};
+        if (!Readvarint(Input, Messagetype) || !Readvarint(Input, Delta) || Messagetype > UINT32_MAX) [[unlikely]] return false;
+
+        Header.Messagetype = uint32_t(Messagetype);
+        Header.Timestamp = int64_t(uint64_t(Header.Epoch) + Delta);
+        Payload = Input;
+        return true;
+    }
+}
@@ -184,6 +184,193 @@ int main()
 
     }();
 
+    // Encoding/Framing.hpp
+    [[maybe_unused]] const auto Bundletest = []() -> bool
+    {
+        const std::vector<Blob_t> Messages{ Blob_t(100, 'A'), Blob_t(), Blob_t(1, 'B'), Blob_t(300, 'C') };
+        Blob_t Bundle{};
+        for (const auto &Message : Messages) Framing::Appendbundle(Bundle, Message);
+
+        // Round-trip.
+        std::vector<Blob_t> Parsed{};
+        const auto Collect = [&](const Blob_t &Input)
+        {
+            Parsed.clear();
+            return Framing::Unbundle(Input, [&](size_t Offset, size_t Size) { Parsed.emplace_back(Input.substr(Offset, Size)); });
+        };
+        if (Collect(Bundle) != Messages.size() || Parsed != Messages) printf("BROKEN: Framing bundling\n");
+
+        // Plain messages and bare magic.
+        if (Framing::isBundle(Messages[0]) || Collect(Messages[0]) != 0) printf("BROKEN: Framing bundle detection\n");
+        if (Collect(Bundle.substr(0, sizeof(Framing::Bundlemagic))) != 0) printf("BROKEN: Framing empty bundle\n");
+
+        // Truncated anywhere, only the complete messages come out and never read past the end.
+        for (size_t Size = sizeof(Framing::Bundlemagic); Size < Bundle.size(); ++Size)
+        {
+            const auto Truncated = Bundle.substr(0, Size);
+            const auto Count = Collect(Truncated);
+            if (Count >= Messages.size() || !std::equal(Parsed.begin(), Parsed.end(), Messages.begin())) printf("BROKEN: Framing truncated bundle\n");
+        }
+
+        // A length past the end.
+        auto Oversized = Bundle;
+        const uint16_t Length = UINT16_MAX;
+        std::memcpy(Oversized.data() + sizeof(Framing::Bundlemagic), &Length, sizeof(Length));
+        if (Collect(Oversized) != 0) printf("BROKEN: Framing oversized length\n");
+
+        return true;
+    }();
+    [[maybe_unused]] const auto Fragmenttest = []() -> bool
+    {
+        Blob_t Message(5000, 0);
+        for (size_t i = 0; i < Message.size(); ++i) Message[i] = uint8_t(i * 7);
+
+        const Framing::Reassembler_t::Limits_t Limits{ 100, 8192, 12000, std::chrono::milliseconds(1000) };
+        const auto Now = std::chrono::steady_clock::now();
+        auto Frames = Framing::Fragment(Message, 42, 1472);
+        if (Frames.size() != 4 || std::ranges::any_of(Frames, [](const auto &Frame) { return Frame.size() > 1472; })) printf("BROKEN: Framing fragmenting\n");
+
+        // Round-trip in any order, duplicates ignored.
+        {
+            Framing::Reassembler_t Reassembler{};
+            std::ranges::reverse(Frames);
+            Frames.insert(Frames.begin() + 1, Frames[0]);
+
+            size_t Completed{};
+            for (const auto &Frame : Frames)
+            {
+                const auto Result = Reassembler.Insert(Frame, Limits, Now);
+                if (!Result.Message.empty()) { ++Completed; if (!std::ranges::equal(Result.Message, Message)) printf("BROKEN: Framing reassembly\n"); }
+            }
+            if (Completed != 1 || Reassembler.size() || Reassembler.bytes()) printf("BROKEN: Framing reassembly\n");
+        }
+
+        // Malformed headers never start a message.
+        {
+            Framing::Reassembler_t Reassembler{};
+            const auto Mutate = [&](auto &&Change)
+            {
+                auto Frame = Framing::Fragment(Message, 43, 1472)[1];
+                Framing::Fragmentheader_t Header;
+                std::memcpy(&Header, Frame.data() + sizeof(Framing::Fragmentmagic), sizeof(Header));
+                Change(Header);
+                std::memcpy(Frame.data() + sizeof(Framing::Fragmentmagic), &Header, sizeof(Header));
+                return Reassembler.Insert(Frame, Limits, Now).Message.empty();
+            };
+
+            if (!Mutate([](auto &Header) { Header.Count = 1; Header.Index = 0; })) printf("BROKEN: Framing single fragment\n");
+            if (!Mutate([](auto &Header) { Header.Index = Header.Count; })) printf("BROKEN: Framing fragment index\n");
+            if (!Mutate([](auto &Header) { Header.Totalsize = 9000; })) printf("BROKEN: Framing fragment maxsize\n");
+            if (!Mutate([](auto &Header) { Header.Totalsize = 50; })) printf("BROKEN: Framing fragment minsize\n");
+            if (!Mutate([](auto &Header) { Header.Offset = 4000; })) printf("BROKEN: Framing fragment offset\n");
+            if (Reassembler.size()) printf("BROKEN: Framing malformed fragments\n");
+
+            // Truncated headers and other datagrams.
+            const auto Frame = Framing::Fragment(Message, 44, 1472)[0];
+            for (size_t Size = 0; Size < Framing::Fragmentoverhead; ++Size)
+                if (!Reassembler.Insert(std::span(Frame.data(), Size), Limits, Now).Message.empty()) printf("BROKEN: Framing truncated fragment\n");
+            if (!Reassembler.Insert(Message, Limits, Now).Message.empty() || Reassembler.size()) printf("BROKEN: Framing fragment detection\n");
+
+            // Later fragments must agree with the first.
+            (void)Reassembler.Insert(Frame, Limits, Now);
+            if (!Mutate([](auto &Header) { Header.MessageID = 44; Header.Totalsize = 4000; })) printf("BROKEN: Framing fragment mismatch\n");
+        }
+
+        // Overlapping or short slices could leave parts of the buffer unwritten.
+        {
+            Framing::Reassembler_t Reassembler{};
+            auto Overlapping = Framing::Fragment(Message, 45, 1472);
+            Framing::Fragmentheader_t Header;
+            std::memcpy(&Header, Overlapping[1].data() + sizeof(Framing::Fragmentmagic), sizeof(Header));
+            Header.Offset -= 100;
+            std::memcpy(Overlapping[1].data() + sizeof(Framing::Fragmentmagic), &Header, sizeof(Header));
+            Overlapping[2].resize(Overlapping[2].size() - 10);
+
+            for (const auto &Frame : Overlapping)
+                if (!Reassembler.Insert(Frame, Limits, Now).Message.empty()) printf("BROKEN: Framing overlapping fragments\n");
+
+            // Same count, but the larger slices leave a gap before the last one.
+            auto Mixed = Framing::Fragment(Message, 46, 1300 + Framing::Fragmentoverhead);
+            Mixed.back() = Framing::Fragment(Message, 46, 1472).back();
+            if (Mixed.size() != 4) printf("BROKEN: Framing fragmenting\n");
+
+            for (const auto &Frame : Mixed)
+                if (!Reassembler.Insert(Frame, Limits, Now).Message.empty()) printf("BROKEN: Framing mixed slicesizes\n");
+        }
+
+        // Stale messages expire, and the budget evicts the oldest.
+        {
+            Framing::Reassembler_t Reassembler{};
+            (void)Reassembler.Insert(Framing::Fragment(Message, 1, 1472)[0], Limits, Now);
+            (void)Reassembler.Insert(Framing::Fragment(Message, 2, 1472)[0], Limits, Now + std::chrono::milliseconds(500));
+            const auto Expired = Reassembler.Insert(Framing::Fragment(Message, 3, 1472)[0], Limits, Now + std::chrono::milliseconds(1200));
+            if (Expired.Expired != 1 || Reassembler.size() != 2) printf("BROKEN: Framing fragment expiry\n");
+
+            const auto Evicted = Reassembler.Insert(Framing::Fragment(Message, 4, 1472)[0], Limits, Now + std::chrono::milliseconds(1300));
+            if (Evicted.Evicted != 1 || Reassembler.size() != 2 || Reassembler.bytes() > Limits.Budget) printf("BROKEN: Framing fragment budget\n");
+        }
+
+        return true;
+    }();
+    [[maybe_unused]] const auto Compacttest = []() -> bool
+    {
+        // Envelope-marked timestamps have the sign bit set.
+        Framing::Compactheader_t Input{ Framing::Fullkey | Framing::Announce, {}, {}, 0x1122334455667788ULL, INT64_MIN | 1000000, 0xDEADBEEF, INT64_MIN | 1000123 };
+        for (size_t i = 0; i < Input.Signature.size(); ++i) Input.Signature[i] = uint8_t(i);
+        for (size_t i = 0; i < Input.Publickey.size(); ++i) Input.Publickey[i] = uint8_t(i * 3);
+        const Blob_t Payload(50, 'P');
+
+        const auto Unknown = [](uint64_t, qDSA::Publickey_t &, int64_t &) { return false; };
+        const auto Known = [&](uint64_t ShortID, qDSA::Publickey_t &Publickey, int64_t &Epoch)
+        {
+            Publickey = Input.Publickey;
+            Epoch = Input.Epoch;
+            return ShortID == Input.ShortID;
+        };
+        const auto Matches = [&](const Framing::Compactheader_t &Output, std::span<const uint8_t> Body)
+        {
+            return Output.Flags == Input.Flags && Output.Signature == Input.Signature && Output.Publickey == Input.Publickey &&
+                   Output.Epoch == Input.Epoch && Output.Messagetype == Input.Messagetype && Output.Timestamp == Input.Timestamp && std::ranges::equal(Body, Payload);
+        };
+
+        // Round-trip with the full key, needs no lookup.
+        const auto Full = Framing::Encodecompact(Input, Payload);
+        Framing::Compactheader_t Output{};
+        std::span<const uint8_t> Body{};
+        if (!Framing::Decodecompact(Full, Output, Body, Unknown) || !Matches(Output, Body)) printf("BROKEN: Framing compact fullkey\n");
+
+        // And with the ShortID, which needs the announced key.
+        Input.Flags = 0;
+        const auto Short = Framing::Encodecompact(Input, Payload);
+        if (Short.size() >= Full.size()) printf("BROKEN: Framing compact size\n");
+        if (Framing::Decodecompact(Short, Output, Body, Unknown)) printf("BROKEN: Framing compact lookup\n");
+        if (!Framing::Decodecompact(Short, Output, Body, Known) || !Matches(Output, Body)) printf("BROKEN: Framing compact shortid\n");
+
+        // Truncated anywhere in the header.
+        for (size_t Size = 0; Size < Short.size() - Payload.size(); ++Size)
+            if (Framing::Decodecompact(Short.substr(0, Size), Output, Body, Known)) printf("BROKEN: Framing compact truncated\n");
+        for (size_t Size = 0; Size < Full.size() - Payload.size(); ++Size)
+            if (Framing::Decodecompact(Full.substr(0, Size), Output, Body, Known)) printf("BROKEN: Framing compact truncated\n");
+
+        // Overlong varints and messagetypes.
+        auto Overlong = Short.substr(0, sizeof(Framing::Compactmagic) + 1 + 64 + 8);
+        Overlong.append(11, 0x80);
+        if (Framing::Decodecompact(Overlong, Output, Body, Known)) printf("BROKEN: Framing compact varint\n");
+
+        Blob_t Varint{};
+        Framing::Writevarint(Varint, UINT64_MAX);
+        std::span<const uint8_t> Cursor(Varint);
+        uint64_t Value{};
+        if (Varint.size() != 10 || !Framing::Readvarint(Cursor, Value) || Value != UINT64_MAX || !Cursor.empty()) printf("BROKEN: Framing varint\n");
+
+        auto Widetype = Short.substr(0, sizeof(Framing::Compactmagic) + 1 + 64 + 8);
+        Framing::Writevarint(Widetype, uint64_t(UINT32_MAX) + 1);
+        Framing::Writevarint(Widetype, 0);
+        if (Framing::Decodecompact(Widetype, Output, Body, Known)) printf("BROKEN: Framing compact messagetype\n");
+
+        return true;
+    }();
+
     // Crypto/Checksums.hpp
     [[maybe_unused]] const auto Checksumtest = []() -> bool
     {
@@ -305,6 +492,143 @@ int main()
         return true;
     }();
 
+    // Containers/MPSCQueue.hpp
+    [[maybe_unused]] const auto MPSCQueuetest = []() -> bool
+    {
+        // 4 element capacity.
+        MPSCQueue_t<int, 4> Queue;
+        int Expected{};
+
+        for (int i = 0; i < 4; ++i)
+        {
+            if (!Queue.try_push(i)) printf("BROKEN: MPSCQueue insertion\n");
+        }
+        if (Queue.try_push(4)) printf("BROKEN: MPSCQueue capacity\n");
+
+        // Drain part of it, then wrap around.
+        if (2 != Queue.drain([&](int &&Value) { if (Value != Expected++) printf("BROKEN: MPSCQueue order\n"); }, 2))
+            printf("BROKEN: MPSCQueue batching\n");
+        if (!Queue.try_emplace(4) || !Queue.try_emplace(5))
+            printf("BROKEN: MPSCQueue wraparound\n");
+        if (4 != Queue.drain([&](int &&Value) { if (Value != Expected++) printf("BROKEN: MPSCQueue order\n"); }))
+            printf("BROKEN: MPSCQueue drain\n");
+
+        const auto Stats = Queue.getStatistics();
+        if (Stats.Pushed != 6 || Stats.Rejected != 1 || Stats.Highwater != 4 || !Queue.empty())
+            printf("BROKEN: MPSCQueue statistics\n");
+
+        return true;
+    }();
+
+    // Containers/Bufferpool.hpp
+    [[maybe_unused]] const auto Bufferpooltest = []() -> bool
+    {
+        // 2 pooled buffers, the third comes from the heap.
+        Bufferpool_t<16, 2> Pool;
+
+        {
+            auto A = Pool.Acquire(); auto B = Pool.Acquire(); auto C = Pool.Acquire();
+            if (Pool.getStatistics().Fallbacks != 1 || Pool.getStatistics().Available != 0)
+                printf("BROKEN: Bufferpool allocation\n");
+
+            // Views keep the buffer alive.
+            std::memset(A.data(), 0xAA, A.size());
+            const auto View = A.subspan(4, 8);
+            A = {};
+
+            if (View.size() != 8 || View.data()[0] != 0xAA || View.use_count() != 1)
+                printf("BROKEN: Bufferpool views\n");
+            if (Pool.getStatistics().Available != 0)
+                printf("BROKEN: Bufferpool release\n");
+        }
+
+        if (Pool.getStatistics().Available != 2)
+            printf("BROKEN: Bufferpool recycling\n");
+
+        return true;
+    }();
+
+    // Containers/Seenfilter.hpp
+    [[maybe_unused]] const auto Seenfiltertest = []() -> bool
+    {
+        // 4 element LRU.
+        Seenfilter_t<uint64_t, 4> Filter;
+
+        for (uint64_t i = 0; i < 4; ++i)
+        {
+            if (Filter.testandSet(i)) printf("BROKEN: Seenfilter insertion\n");
+        }
+
+        // Refresh the first key, then evict the second.
+        if (!Filter.testandSet(0)) printf("BROKEN: Seenfilter lookup\n");
+        if (Filter.testandSet(4)) printf("BROKEN: Seenfilter insertion\n");
+        if (Filter.contains(1) || !Filter.contains(0)) printf("BROKEN: Seenfilter eviction\n");
+
+        const auto Stats = Filter.getStatistics();
+        if (Stats.Inserts != 5 || Stats.Hits != 2) printf("BROKEN: Seenfilter statistics\n");
+
+        return true;
+    }();
+
+    // Containers/Setdigest.hpp
+    [[maybe_unused]] const auto Setdigesttest = []() -> bool
+    {
+        // Two peers with overlapping sets.
+        std::mt19937_64 Random(42);
+        std::vector<uint64_t> A{}, B{};
+        for (int i = 0; i < 100; ++i)
+        {
+            const auto ID = Random();
+            if (i % 7) A.emplace_back(ID);
+            if (i % 5) B.emplace_back(ID);
+        }
+        std::ranges::sort(A); std::ranges::sort(B);
+
+        const auto Summary = [](const std::vector<uint64_t> &Set)
+        {
+            Setdigest_t Digest{};
+            for (const auto ID : Set) Digest.insert(ID);
+            return Digest;
+        };
+        if (Summary(A) == Summary(B)) printf("BROKEN: Setdigest comparison\n");
+
+        // Independent of the order and grouping.
+        Setdigest_t Odd{}, Even{};
+        for (size_t i = 0; i < A.size(); ++i) (i & 1 ? Odd : Even).insert(A[A.size() - 1 - i]);
+        Odd.merge(Even);
+        if (!(Odd == Summary(A))) printf("BROKEN: Setdigest merging\n");
+
+        // Every ID falls in exactly one chunk, an empty set is one chunk covering everything.
+        const auto Chunks = Setdigest_t::Chunk(B, 8);
+        for (const auto ID : A)
+        {
+            if (1 != std::ranges::count_if(Chunks, [=](const auto &Chunk) { return ID >= Chunk.Low && ID <= Chunk.High; }))
+                printf("BROKEN: Setdigest chunking\n");
+        }
+        if (const auto Empty = Setdigest_t::Chunk({}, 8); Empty.size() != 1 || Empty[0].Low != 0 || Empty[0].High != UINT64_MAX)
+            printf("BROKEN: Setdigest chunking\n");
+        if (Setdigest_t::Chunk(B, 0).size() != B.size()) printf("BROKEN: Setdigest empty chunks\n");
+
+        // Loopback: each side lists its IDs, the other sends what is not listed.
+        const auto Exchange = [](const std::vector<uint64_t> &From, std::vector<uint64_t> &To)
+        {
+            std::vector<uint64_t> Sent{};
+            for (const auto &Chunk : Setdigest_t::Chunk(To, 8))
+            {
+                for (const auto ID : From)
+                    if (Setdigest_t::Lacks(Chunk, ID)) Sent.emplace_back(ID);
+            }
+
+            To.insert(To.end(), Sent.begin(), Sent.end());
+            std::ranges::sort(To);
+        };
+        Exchange(A, B); Exchange(B, A);
+
+        if (A != B || !(Summary(A) == Summary(B))) printf("BROKEN: Setdigest reconciliation\n");
+
+        return true;
+    }();
+
     // Containers/Bytebuffer.hpp
     [[maybe_unused]] const auto Bytebuffertest = []() -> bool
     {
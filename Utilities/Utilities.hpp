@@ -74,8 +74,12 @@
 using namespace std::literals;
 
 // All utilities.
+#include "Containers/Bufferpool.hpp"
 #include "Containers/Bytebuffer.hpp"
+#include "Containers/MPSCQueue.hpp"
 #include "Containers/Ringbuffer.hpp"
+#include "Containers/Seenfilter.hpp"
+#include "Containers/Setdigest.hpp"
 
 #include "Crypto/Checksums.hpp"
 #include "Crypto/HWID.hpp"
@@ -87,6 +91,7 @@ using namespace std::literals;
 #include "Encoding/Base58.hpp"
 #include "Encoding/Base64.hpp"
 #include "Encoding/Base85.hpp"
+#include "Encoding/Framing.hpp"
 #include "Encoding/JSON.hpp"
 #include "Encoding/UTF8.hpp"
 
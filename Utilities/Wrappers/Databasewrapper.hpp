@@ -160,8 +160,10 @@ namespace sqlite
 
             if constexpr (Optional_t<T>)
             {
-                if (Value) return bindValue(Statement, Index, *Value);
-                else return sqlite3_bind_null(Statement, Index);
+                // The inner bind asserts on its own result.
+                if (!Value) return sqlite3_bind_null(Statement, Index);
+                bindValue(Statement, Index, *Value);
+                return SQLITE_OK;
             }
 
             // Should never happen.